@@ -3,9 +3,13 @@
 // Copyright (c) 2022 Naoki Yoshinaga <ynaga@iis.u-tokyo.ac.jp>
 // Modification by Copyright 2023 - Present, Light Transport Entertainment Inc.
 #include "jagger.h"
-
-static const size_t MAX_KEY_BITS     = 14;
-static const size_t MAX_FEATURE_BITS = 7;
+#if !defined(_WIN32)
+#include <sys/uio.h>
+#include <climits>
+#endif
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #ifdef _WIN32
 static std::wstring UTF8ToWchar(const std::string &str) {
@@ -75,46 +79,235 @@ static bool FileExists(const std::string &filepath) {
 
 
 
-namespace ccedar {
-  class da_ : public ccedar::da <int, int, MAX_KEY_BITS> {
-  public:
-    struct utf8_feeder { // feed one UTF-8 character by one while mapping codes
-      const char *p, * const end;
-      utf8_feeder (const char *key_, const char *end_) : p (key_), end (end_) {}
-      int read (int &b) const { return p == end ? 0 : unicode (p, b); }
-      void advance (const int b) { p += b; }
-    };
-    int longestPrefixSearchWithPOS (const char* key, const char* const end, int fi_prev, const uint16_t* const c2i, size_t from = 0) const {
-      size_t from_ = 0;
-      int n (0), i (0), b (0);
-      for (utf8_feeder f (key, end); (i = c2i[f.read (b)]); f.advance (b)) {
-        size_t pos = 0;
-        const int n_ = traverse (&i, from, pos, pos + 1);
-        if (n_ == CEDAR_NO_VALUE) continue;
-        if (n_ == CEDAR_NO_PATH)  break;
-        from_ = from;
-        n = n_;
-      }
-      // ad-hock matching at the moment; it prefers POS-ending patterns
-      if (! fi_prev) return n;
-      for (const node* const array_ = reinterpret_cast <const node*> (array ());
-           ; from = array_[from].check) { // hopefully, in the cache
-        const int n_ = exactMatchSearch <int> (&fi_prev, 1, from);
-        if (n_ != CEDAR_NO_VALUE) return n_;
-        if (from == from_)        return n;
+// line-aligned blocks of input passed from the reader to tagging workers
+// and then to the writer in input order (-j); at most blocks.size () blocks
+// are in flight, which bounds memory
+class block_pipeline {
+public:
+  struct block {
+    std::vector <char> in, out;
+    const char* data; // lines of the block (in in or a mapped file)
+    size_t len;
+    size_t used;      // bytes written to out
+    size_t seq;
+    bool   last;
+    block () : in (), out (), data (0), len (0), used (0), seq (0), last (false) {}
+  };
+  explicit block_pipeline (const size_t k) : _blocks (k), _free (), _todo (), _done (k, 0), _seq (0), _next (0), _closed (false), _mu (), _cv () {
+    for (size_t i = 0; i < k; ++i) _free.push_back (&_blocks[i]);
+  }
+  block* acquire () { // reader; waits for the writer to release a block
+    std::unique_lock <std::mutex> lock (_mu);
+    _cv.wait (lock, [this] { return ! _free.empty (); });
+    block* b = _free.back ();
+    _free.pop_back ();
+    return b;
+  }
+  void push (block* b, const bool last) { // reader
+    std::lock_guard <std::mutex> lock (_mu);
+    b->seq = _seq++;
+    b->last = last;
+    _todo.push_back (b);
+    _closed = last;
+    _cv.notify_all ();
+  }
+  block* pop () { // worker; 0 after the last block
+    std::unique_lock <std::mutex> lock (_mu);
+    _cv.wait (lock, [this] { return ! _todo.empty () || _closed; });
+    if (_todo.empty ()) return 0;
+    block* b = _todo.front ();
+    _todo.erase (_todo.begin ());
+    return b;
+  }
+  void finish (block* b) { // worker
+    std::lock_guard <std::mutex> lock (_mu);
+    _done[b->seq % _done.size ()] = b;
+    _cv.notify_all ();
+  }
+  // writer; waits for the next block in input order and takes the blocks
+  // done after it as well
+  void next (std::vector <block*>& ready) {
+    std::unique_lock <std::mutex> lock (_mu);
+    _cv.wait (lock, [this] { return _done[_next % _done.size ()] != 0; });
+    ready.clear ();
+    while (block* b = _done[_next % _done.size ()]) {
+      _done[_next++ % _done.size ()] = 0;
+      ready.push_back (b);
+      if (b->last) break;
+    }
+  }
+  void release (block* b) { // writer
+    std::lock_guard <std::mutex> lock (_mu);
+    _free.push_back (b);
+    _cv.notify_all ();
+  }
+private:
+  std::vector <block> _blocks;
+  std::vector <block*> _free, _todo, _done;
+  size_t _seq, _next;
+  bool _closed;
+  std::mutex _mu;
+  std::condition_variable _cv;
+};
+
+// cuts stdin (or fd) into blocks of lines; fill: read until the block is
+// full instead of passing the lines of each read () (interactive). gzip
+// input is decompressed here, i.e., on the reader thread.
+class stream_blocks {
+private:
+  input_stream _in;
+  const bool _fill;
+  std::vector <char> _rest; // partial line at the end of the last block
+public:
+  stream_blocks (const int fd, const bool fill) : _in (fd), _fill (fill), _rest () {}
+  bool operator () (block_pipeline::block& b) { // true at EOF
+    if (b.in.size () < std::max (BUF_SIZE, _rest.size () << 1))
+      b.in.resize (std::max (BUF_SIZE, _rest.size () << 1));
+    if (! _rest.empty ()) std::memcpy (&b.in[0], &_rest[0], _rest.size ());
+    size_t size (_rest.size ()), end (0);
+    bool eof (false);
+    do { // read more for a long line
+      if (size == b.in.size ()) b.in.resize (size << 1);
+      const long r = _in.read (&b.in[size], b.in.size () - size);
+      if (r < 0 && _in.error ()) my_errx (1, "%s", _in.error ());
+      if (r <= 0) { eof = true; break; }
+      for (size_t i = size + static_cast <size_t> (r); i > size; --i)
+        if (b.in[i - 1] == '\n') { end = i; break; }
+      size += static_cast <size_t> (r);
+    } while (! end || (_fill && size < b.in.size ()));
+    if (eof) end = size;
+    _rest.assign (b.in.begin () + static_cast <ptrdiff_t> (end), b.in.begin () + static_cast <ptrdiff_t> (size));
+    b.data = b.in.empty () ? 0 : &b.in[0];
+    b.len = end;
+    return eof;
+  }
+};
+
+// reads blocks of lines from fd on a thread while the caller tags lines of
+// the previous block; up to two blocks are read ahead. Without a thread
+// (e.g., on a single core), blocks are read on demand as simple_reader.
+class read_ahead {
+private:
+  block_pipeline _pipeline;
+  stream_blocks _read;
+  std::thread _thread;
+  block_pipeline::block _block; // without a thread
+  block_pipeline::block* _b;
+  const char* _p;
+  const char* _end;
+  read_ahead (const read_ahead&);
+  read_ahead& operator= (const read_ahead&);
+public:
+  read_ahead (const int fd, const bool fill, const bool threaded) : _pipeline (3), _read (fd, fill && threaded), _thread (), _block (), _b (0), _p (0), _end (0) {
+    if (threaded)
+      _thread = std::thread ([this] {
+        for (bool eof = false; ! eof; ) {
+          block_pipeline::block* b = _pipeline.acquire ();
+          eof = _read (*b);
+          _pipeline.push (b, eof);
+        }
+      });
+  }
+  ~read_ahead () { if (_thread.joinable ()) _thread.join (); }
+  size_t gets (const char** line) { // as simple_reader::gets
+    while (_p == _end) {
+      if (_b && _b->last) return 0;
+      if (_thread.joinable ()) {
+        if (_b) _pipeline.release (_b);
+        _b = _pipeline.pop ();
+      } else {
+        _b = &_block;
+        _b->last = _read (*_b);
       }
+      _p = _b->data;
+      _end = _p + _b->len;
     }
-  };
-}
+    const void* eol = std::memchr (_p, '\n', static_cast <size_t> (_end - _p));
+    *line = _p;
+    _p = eol ? static_cast <const char*> (eol) + 1 : _end;
+    return static_cast <size_t> (_p - *line);
+  }
+  // whether the next line is read, i.e., gets () returns it without waiting
+  bool ready () const { return _p != _end; }
+};
+
+// read-only mapping of an input file (-i); lines are tagged in place
+class mapped_file {
+private:
+  const char* _data;
+  size_t _size;
+  mapped_file (const mapped_file&);
+  mapped_file& operator= (const mapped_file&);
+public:
+  mapped_file () : _data (0), _size (0) {}
+  ~mapped_file () {
+    if (! _data) return;
+#if defined(_WIN32)
+    UnmapViewOfFile (_data);
+#else
+    ::munmap (const_cast <char*> (_data), _size);
+#endif
+  }
+  // false if fd is not a regular file
+  bool map (const int fd) {
+#if defined(_WIN32)
+    const __int64 size = _lseeki64 (fd, 0, SEEK_END);
+    if (size < 0 || GetFileType (reinterpret_cast <HANDLE> (_get_osfhandle (fd))) != FILE_TYPE_DISK) return false;
+    _lseeki64 (fd, 0, SEEK_SET);
+    _size = static_cast <size_t> (size);
+    if (! _size) return true;
+    HANDLE hMapping = CreateFileMappingA (reinterpret_cast <HANDLE> (_get_osfhandle (fd)), NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping == NULL) my_errx (1, "%s", "CreateFileMappingA failed for input");
+    _data = static_cast <const char*> (MapViewOfFile (hMapping, FILE_MAP_READ, 0, 0, 0));
+    CloseHandle (hMapping);
+    if (! _data) my_errx (1, "%s", "MapViewOfFile failed for input");
+#else
+    struct stat st;
+    if (::fstat (fd, &st) != 0 || ! S_ISREG (st.st_mode)) return false;
+    _size = static_cast <size_t> (st.st_size);
+    if (! _size) return true;
+    void* data = ::mmap (0, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) my_errx (1, "%s", "mmap failed for input");
+#if defined(MADV_SEQUENTIAL)
+    ::madvise (data, _size, MADV_SEQUENTIAL);
+#endif
+    _data = static_cast <const char*> (data);
+#endif
+    return true;
+  }
+  const char* data () const { return _data; }
+  size_t size () const { return _size; }
+};
+
+// cuts a mapped file into blocks of lines without copy
+class mapped_blocks {
+private:
+  const char* _p;
+  const char* const _end;
+public:
+  explicit mapped_blocks (const mapped_file& file) : _p (file.data ()), _end (file.data () + file.size ()) {}
+  bool operator () (block_pipeline::block& b) { // true at the last block
+    const char* q = _p + std::min (BUF_SIZE, static_cast <size_t> (_end - _p));
+    if (q < _end) {
+      const void* eol = std::memchr (q, '\n', static_cast <size_t> (_end - q));
+      q = eol ? static_cast <const char*> (eol) + 1 : _end;
+    }
+    b.data = _p;
+    b.len = static_cast <size_t> (q - _p);
+    _p = q;
+    return _p == _end;
+  }
+};
 
 namespace jagger {
   class tagger {
   private:
     ccedar::da_ da;
-    uint16_t* c2i; // mapping from utf8, BOS, unk to character ID
-    uint64_t* p2f; // mapping from pattern ID to feature strings
-    char*     fs;  // feature strings
+    c2i_map         c2i; // mapping from utf8, BOS, unk to character ID
+    const uint64_t* p2f; // mapping from pattern ID to feature strings
+    const char*     fs;  // feature strings
     std::vector <std::pair <void*, size_t> > mmaped;
+    std::vector <uint32_t> visits; // node visits (profiling)
     static inline void write_string (char* &p, const char* s, size_t len = 0) {
 #ifdef USE_COMPACT_DICT
       if (! len) {
@@ -130,13 +323,6 @@ namespace jagger {
       ::write (1, buf, static_cast <size_t> (p - buf));
       p = buf;
     }
-    template <typename T>
-    static inline void write_array (T& data, const std::string& fn) {
-      FILE *fp = std::fopen (fn.c_str (), "wb");
-      if (! fp) my_errx (1, "no such file: %s", fn.c_str ());
-      std::fwrite (&data[0], sizeof (typename T::value_type), data.size (), fp);
-      std::fclose (fp);
-    }
     void* read_array (const std::string& fn, size_t &bufsize) {
       int fd = ::open (fn.c_str (), O_RDONLY);
       if (fd == -1) my_errx (1, "no such file: %s", fn.c_str ());
@@ -156,7 +342,7 @@ namespace jagger {
       CloseHandle(hMapping);
 #else
       void *data = ::mmap (0, size, PROT_READ, MAP_SHARED, fd, 0);
-      if (!data) {
+      if (data == MAP_FAILED) {
         my_errx(1, "mmap failed for: %s", fn.c_str());
       }
 #endif
@@ -165,8 +351,16 @@ namespace jagger {
       bufsize = size;
       return data;
     }
+    void unmap_last () { // release an array no longer referred to
+#if defined(_WIN32)
+      UnmapViewOfFile (mmaped.back ().first);
+#else
+      ::munmap (mmaped.back ().first, mmaped.back ().second);
+#endif
+      mmaped.pop_back ();
+    }
   public:
-    tagger () : da (), c2i (0), p2f (0), fs (0), mmaped () {}
+    tagger () : da (), c2i (), p2f (0), fs (0), mmaped (), visits () {}
     ~tagger () {
       for (size_t i = 0; i < mmaped.size (); ++i)
 #if defined(_WIN32)
@@ -177,181 +371,297 @@ namespace jagger {
         ::munmap (mmaped[i].first, mmaped[i].second);
 #endif
     }
-    void read_model (const std::string& m) { // read patterns to memory
+    void read_packed_model (const std::string& fn) { // one mmap for all arrays
+      size_t size (0), da_size (0), c2i_size (0);
+      const void* data = read_array (fn, size);
+      packed_model pm;
+      if (const char* err = pm.open (data, size))
+        my_errx (1, "%s", (fn + ": " + err).c_str ());
+      const void* da_buf = pm.section (JGM_DA, da_size);
+      const void* c2i_buf = pm.section (JGM_C2I_PAGED, c2i_size);
+      if (c2i_buf) {
+        if (! c2i.set_array (c2i_buf, c2i_size))
+          my_errx (1, "corrupted character mapping in packed model: %s", fn.c_str ());
+        advise_section (c2i_buf, c2i_size, true);
+      } else if ((c2i_buf = pm.section (JGM_C2I, c2i_size))) // flat table
+        c2i.build (static_cast <const uint16_t*> (c2i_buf), c2i_size / sizeof (uint16_t));
+      p2f = static_cast <const uint64_t*> (pm.section (JGM_P2F, size));
+      fs  = static_cast <const char*> (pm.section (JGM_FS, size));
+      if (! da_buf || ! c2i_buf || ! p2f || ! fs)
+        my_errx (1, "missing section in packed model: %s", fn.c_str ());
+      da.set_array (da_buf, da_size);
+      advise_section (da_buf, da_size, true);
+      if (const void* hot = pm.section (JGM_HOT, size)) {
+        if (! da.set_hot (hot, size))
+          my_errx (1, "corrupted hot core in packed model: %s", fn.c_str ());
+        advise_section (hot, size, false);
+      }
+      if (const void* pos = pm.section (JGM_POS, size))
+        if (! da.set_pos (pos, size))
+          my_errx (1, "corrupted POS-context table in packed model: %s", fn.c_str ());
+    }
+    // strict: never compile patterns here; use jagger-compile in advance
+    void read_model (const std::string& m, const bool strict = false) { // read patterns to memory
+      const std::string jgm_fn (m.size () > 4 && m.compare (m.size () - 4, 4, ".jgm") == 0 ? m : m + ".jgm");
+      if (FileExists (jgm_fn)) return read_packed_model (jgm_fn);
       const std::string da_fn (m + ".da"), c2i_fn (m + ".c2i"), p2f_fn (m + ".p2f"), fs_fn (m + ".fs");
-      //struct stat st;
-      //if (::stat (da_fn.c_str (), &st) != 0) { // compile
-      if (!FileExists(da_fn)) {
-        std::fprintf (stderr, "building DA trie from patterns..");
-        std::vector <uint16_t> c2i_; // mapping from utf8, BOS, unk to char ID
-        std::vector <uint64_t> p2f_; // mapping from pattern ID to feature str
-        std::vector <char>      fs_; // feature strings
-        sbag_t fbag ("\tBOS");
-#ifdef USE_COMPACT_DICT
-        fbag.to_i (FEAT_UNK);
-        sbag_t fbag_ (",*,*,*\n");
-#else
-        sbag_t fbag_ ((std::string (FEAT_UNK) + ",*,*,*\n").c_str ());
-#endif
-        std::map <uint64_t, int> fs2pid;
-        fs2pid.insert (std::make_pair ((1ull << 32) | 2, fs2pid.size ()));
-        p2f_.push_back ((1ull << 32) | 2);
-        // count each character to obtain dense mapping
-        std::vector <std::pair <size_t, int> > counter (CP_MAX + 3);
-        for (int u = 0; u < counter.size (); ++u) // allow 43 bits for counting
-          counter[u] = std::make_pair (0, u);
-        std::vector <std::pair <std::string, uint64_t > > keys;
-        char *line = 0;
-        simple_reader reader (m.c_str ());
-        while (const size_t len = reader.gets (&line)) { // find pos offset
-          // pattern format: COUNT PATTEN PREV_POS BYTES CHAR_TYPE FEATURES
-          char *p (line), * const p_end (p + len);
-          const size_t count = std::strtoul (p, &p, 10);
-          const char *pat = ++p;
-          for (int b = 0; *p != '\t'; p += b)
-            counter[unicode (p, b)].first += count + 1;
-          size_t fi_prev = 0;
-          const char* f_prev = p; // starting with '\t'
-          if (*++p != '\t') { // with pos context
-            p = const_cast <char*> (skip_to (p, 1, '\t')) - 1;
-            fi_prev = fbag.to_i (f_prev, p - f_prev) + 1;
-            if (fi_prev + CP_MAX == counter.size ()) // new part-of-speech
-              counter.push_back (std::make_pair (0, (fi_prev + CP_MAX)));
-            counter[fi_prev + CP_MAX].first += count + 1;
+      if (! FileExists (da_fn)) { // compile
+        if (strict) my_errx (1, "model is not compiled (run jagger-compile): %s", m.c_str ());
+        std::fprintf (stderr, "building DA trie from patterns..\n");
+        model_compiler compiler;
+        compiler.compile (m);
+        compiler.save (m);
+      }
+      size_t bufsize;
+      const void *da_buf = read_array(da_fn, bufsize);
+      da.set_array (da_buf, bufsize); // use the mapped pages directly
+      c2i.build (static_cast <const uint16_t*> (read_array (c2i_fn, bufsize)), bufsize / sizeof (uint16_t));
+      unmap_last (); // only the paged copy is used
+      p2f = static_cast <const uint64_t*> (read_array (p2f_fn, bufsize));
+      fs  = static_cast <const char*> (read_array (fs_fn, bufsize));
+      if (FileExists (m + ".hot")) {
+        const void* hot = read_array (m + ".hot", bufsize);
+        if (! da.set_hot (hot, bufsize)) {
+          std::fprintf (stderr, "jagger: warn: ignore %s.hot built for another trie\n", m.c_str ());
+          unmap_last ();
+        }
+      }
+      if (FileExists (m + ".pos")) { // POS-context table (jagger-compile)
+        const void* pos = read_array (m + ".pos", bufsize);
+        if (! da.set_pos (pos, bufsize)) {
+          std::fprintf (stderr, "jagger: warn: ignore %s.pos built for another trie\n", m.c_str ());
+          unmap_last ();
+        }
+      }
+    }
+    // count node visits of the trie; they are added to those in fn if fn is
+    // recorded with the same trie
+    void profile (const std::string& fn) {
+      visits.assign (da.size (), 0);
+      profile_header h;
+      if (FILE* fp = std::fopen (fn.c_str (), "rb")) {
+        if (std::fread (&h, sizeof (h), 1, fp) == 1 && std::memcmp (h.magic, "JAGGERP", 8) == 0 &&
+            h.da_nodes == da.size () && h.da_digest == da_digest (da.array (), da.size () * sizeof (ccedar::da_::node)))
+          std::fread (&visits[0], sizeof (uint32_t), visits.size (), fp);
+        else
+          std::fprintf (stderr, "jagger: warn: overwrite %s recorded with another trie\n", fn.c_str ());
+        std::fclose (fp);
+      }
+      da.profile (&visits[0]);
+    }
+    void save_profile (const std::string& fn) const {
+      profile_header h;
+      std::memcpy (h.magic, "JAGGERP", 8);
+      h.da_nodes = visits.size ();
+      h.da_digest = da_digest (da.array (), da.size () * sizeof (ccedar::da_::node));
+      std::vector <char> buf (sizeof (h) + visits.size () * sizeof (uint32_t));
+      std::memcpy (&buf[0], &h, sizeof (h));
+      std::memcpy (&buf[sizeof (h)], &visits[0], visits.size () * sizeof (uint32_t));
+      write_file_atomic (&buf[0], buf.size (), fn);
+    }
+    // sink of tag_line writing tokens in MeCab format (or separated by ' '
+    // when ! POS_TAGGING) to the output buffer; the buffer is extended for
+    // each token when buf is given
+    template <const bool POS_TAGGING>
+    struct mecab_writer {
+      char*& ptr;
+      const uint64_t* p2f;
+      const char* fs;
+      const char* line;
+      bool bos;
+      std::vector <char>* buf;
+      mecab_writer (char*& ptr_, const uint64_t* p2f_, const char* fs_, std::vector <char>* buf_ = 0) : ptr (ptr_), p2f (p2f_), fs (fs_), line (0), bos (true), buf (buf_) {}
+      void operator () (const size_t begin, const size_t end, const int r, const bool concat) {
+        if (buf) { // room for surface, feature (< 64k each) and EOS
+          const size_t used = static_cast <size_t> (ptr - &(*buf)[0]), room = end - begin + (1 << 17);
+          if (buf->size () - used < room) {
+            buf->resize (std::max (buf->size () << 1, used + room));
+            ptr = &(*buf)[used];
           }
-          const size_t bytes = std::strtoul (++p, &p, 10);
-          const size_t ctype = std::strtoul (++p, &p, 10);
-          const char* f = p; // starting with '\t'
-          p = const_cast <char*> (skip_to (p, NUM_POS_FIELD, ',')) - 1;
-          const size_t fi_  = fbag.to_i  (f, p - f) + 1;
-#ifndef USE_COMPACT_DICT
-          p = const_cast <char*> (f);
-#endif
-          const size_t fi = fbag_.to_i (p, p_end - p) + 1;
-          if (fi_ + CP_MAX == counter.size ()) // new part-of-speech
-            counter.push_back (std::make_pair (0, fi_ + CP_MAX));
-          std::pair <std::map <uint64_t, int>::iterator, bool> itb
-            = fs2pid.insert (std::make_pair ((fi << 32) | fi_, fs2pid.size ()));
-          if (itb.second) p2f_.push_back ((fi << 32) | fi_);
-          keys.push_back (std::make_pair (std::string (pat, f_prev - pat),
-                                          (((bytes << 23) | ((ctype & 0x7) << 20) | (itb.first->second & 0xfffff)) << 12) | fi_prev));
         }
-        // save c2i
-        std::sort (counter.begin () + 1, counter.end (), std::greater <std::pair <size_t, int> > ());
-        c2i_.resize (counter.size ());
-        for (unsigned int i = 1; i < counter.size () && counter[i].first; ++i)
-          c2i_[counter[i].second] = static_cast <uint16_t> (i);
-        // save feature strings
-        std::vector <size_t> offsets;
+        if (! POS_TAGGING && ! bos) write_string (ptr, " ", 1);
+        bos = false;
+        write_string (ptr, line + begin, end - begin);
+        if (! POS_TAGGING) return;
+        const uint64_t offsets = p2f[r & 0xfffff];
 #ifdef USE_COMPACT_DICT
-        fbag.serialize  (fs_, offsets); // required only for compact dict
-#endif
-        fbag_.serialize (fs_, offsets);
-        write_array (fs_, fs_fn);
-        // save mapping from morpheme ID to morpheme feature strings
-        for (size_t i = 0; i < p2f_.size (); ++i) {
-#ifdef USE_COMPACT_DICT
-          p2f_[i] = (offsets[(p2f_[i] >> 32) - 1 + fbag.size ()] << 34) |
-                    (offsets[(p2f_[i] & 0xffffffff) - 1] << MAX_KEY_BITS) |
+        write_string (ptr, &fs[((offsets >> MAX_KEY_BITS) & 0xfffff)]);
+        if (concat)
+          write_string (ptr, ",*,*,*\n", 7);
+        else
+          write_string (ptr, &fs[(offsets >> 34)]);
 #else
-          const std::string& f = fbag_.to_s ((p2f_[i] >> 32) - 1);
-          const char* q = skip_to (f.c_str (), NUM_POS_FIELD, ',') - 1;
-          p2f_[i] = (offsets[(p2f_[i] >> 32) - 1] << 34) |
-                    (fbag_.to_s ((p2f_[i] >> 32) - 1).size () << (MAX_KEY_BITS + MAX_FEATURE_BITS)) |
-                    (q - f.c_str ()) << MAX_KEY_BITS |
+        if (concat) {
+          write_string (ptr, &fs[(offsets >> 34)], (offsets >> MAX_KEY_BITS) & 0x7f);
+          write_string (ptr, ",*,*,*\n", 7);
+        } else
+          write_string (ptr, &fs[(offsets >> 34)], (offsets >> (MAX_KEY_BITS + MAX_FEATURE_BITS)) & 0x3ff);
 #endif
-                    c2i_[(p2f_[i] & 0xffffffff) + CP_MAX];
-        }
-        write_array (p2f_, p2f_fn);
-        // save pattern trie
-        for (std::vector <std::pair <std::string, uint64_t> >::const_iterator it = keys.begin (); it != keys.end (); ++it) {
-          std::vector <int> key;
-          for (int offset (0), b (0); offset < it->first.size (); offset += b)
-            key.push_back (c2i_[unicode (&it->first[offset], b)]);
-          if (it->second & 0xfff)
-            key.push_back (c2i_[(it->second & 0xfff) + CP_MAX]);
-          da.update (&key[0], key.size ()) = it->second >> 12;
+      }
+    };
+    // tag lines in [p, end) into out from out[used]; out is extended as
+    // needed, so a line can be of any length (-j)
+    template <const bool POS_TAGGING>
+    void tag_lines (const char* p, const char* const end, std::vector <char>& out, size_t& used, char_ids& chars) const {
+      if (out.size () - used < BUF_SIZE)
+        out.resize (std::max (out.size () << 1, used + BUF_SIZE));
+      char* ptr (&out[used]);
+      mecab_writer <POS_TAGGING> writer (ptr, p2f, fs, &out);
+      while (p < end) {
+        const char* q = static_cast <const char*> (std::memchr (p, '\n', static_cast <size_t> (end - p)));
+        const size_t n = chars.decode (p, q ? q : end, c2i);
+        writer.line = p;
+        writer.bos  = true;
+        tag_line (da, p2f, c2i, chars, n, writer);
+        // the writer makes room only for tokens; an empty line writes EOS alone
+        const size_t n_used = static_cast <size_t> (ptr - &out[0]);
+        if (out.size () - n_used < 4) {
+          out.resize (std::max (out.size () << 1, n_used + BUF_SIZE));
+          ptr = &out[n_used];
         }
-        c2i_.resize (CP_MAX + 2); // chop most of part-of-speech mapping
-        write_array (c2i_, c2i_fn);
-        da.save (da_fn.c_str ());
-        std::fprintf (stderr, "done.\n");
+        write_string (ptr, POS_TAGGING ? "EOS\n" : "\n", POS_TAGGING ? 4 : 1);
+        p = q ? q + 1 : end;
       }
-      size_t bufsize;
-      const void *da_buf = read_array(da_fn, bufsize);
-      da.set_array (da_buf, bufsize);
-      c2i = static_cast <uint16_t*> (read_array (c2i_fn, bufsize));
-      p2f = static_cast <uint64_t*> (read_array (p2f_fn, bufsize));
-      fs  = static_cast <char*> (read_array (fs_fn, bufsize));
+      used = static_cast <size_t> (ptr - &out[0]);
     }
-    template <const int BUF_SIZE_, const bool POS_TAGGING>
-    void run () const {
-      if (BUF_SIZE_ == 0) std::fprintf (stderr, "(input: stdin)\n");
-      char _res[BUF_SIZE], *_ptr (&_res[0]), *line (0);
-      simple_reader reader;
-      while (const size_t len = reader.gets (&line)) {
-        int bytes (0), bytes_prev (0), id (0), ctype (0), ctype_prev (0);
-        uint64_t offsets = c2i[CP_MAX + 1];
-        bool bos (true), ret (line[len - 1] == '\n'), concat (false);
-        for (const char *p (line), * const p_end (p + len - ret); p != p_end; bytes_prev = bytes, ctype_prev = ctype, offsets = p2f[static_cast <size_t> (id)], p += bytes) {
-          const int r = da.longestPrefixSearchWithPOS (p, p_end, offsets & 0x3fff, &c2i[0]); // found word
-          id    = r & 0xfffff;
-          bytes = (r >> 23) ? (r >> 23) : u8_len (p);
-          ctype = (r >> 20) & 0x7; // 0: num|unk / 1: alpha / 2: kana / 3: other
-          if (! bos) { // word that may concat with the future context
-            if (ctype_prev != ctype || // different character types
-                ctype_prev == 3 ||     // seen words in non-num/alpha/kana
-                (ctype_prev == 2 && bytes_prev + bytes >= 18)) {
-              if (POS_TAGGING) {
-#ifdef USE_COMPACT_DICT
-                write_string (_ptr, &fs[((offsets >> MAX_KEY_BITS) & 0xfffff)]);
-                if (concat)
-                  write_string (_ptr, ",*,*,*\n", 7);
-                else
-                  write_string (_ptr, &fs[(offsets >> 34)]);
+    static void write_block (const block_pipeline::block& b) {
+      for (size_t i = 0; i < b.used; ) {
+        const long r = static_cast <long> (::write (1, &b.out[i], b.used - i));
+        if (r <= 0) my_errx (1, "%s", "failed to write output");
+        i += static_cast <size_t> (r);
+      }
+    }
+    // write outputs of blocks in order with one writev () if possible
+    static void write_blocks (const std::vector <block_pipeline::block*>& blocks) {
+#if defined(_WIN32)
+      for (size_t i = 0; i < blocks.size (); ++i) write_block (*blocks[i]);
+#else
+#if defined(IOV_MAX)
+      static const size_t max_iov = IOV_MAX;
 #else
-                if (concat) {
-                  write_string (_ptr, &fs[(offsets >> 34)], (offsets >> MAX_KEY_BITS) & 0x7f);
-                  write_string (_ptr, ",*,*,*\n", 7);
-                } else
-                  write_string (_ptr, &fs[(offsets >> 34)], (offsets >> (MAX_KEY_BITS + MAX_FEATURE_BITS)) & 0x3ff);
+      static const size_t max_iov = 16;
 #endif
-                concat = false;
-              } else
-                write_string (_ptr, " ", 1);
-            } else
-              concat = true;
-          } else
-            bos = false;
-          write_string (_ptr, p, static_cast <size_t> (bytes));
+      std::vector <struct iovec> iov;
+      for (size_t i = 0; i < blocks.size (); ++i)
+        if (blocks[i]->used) {
+          struct iovec v;
+          v.iov_base = &blocks[i]->out[0];
+          v.iov_len  = blocks[i]->used;
+          iov.push_back (v);
         }
-        if (! bos) // output fs of last token
-          if (POS_TAGGING) {
-#ifdef USE_COMPACT_DICT
-            write_string (_ptr, &fs[((offsets >> MAX_KEY_BITS) & 0xfffff)]);
-            if (concat)
-              write_string (_ptr, ",*,*,*\n", 7);
-            else
-              write_string (_ptr, &fs[(offsets >> 34)]);
-#else
-            if (concat) {
-              write_string (_ptr, &fs[(offsets >> 34)], (offsets >> MAX_KEY_BITS) & 0x7f);
-              write_string (_ptr, ",*,*,*\n", 7);
-            } else
-              write_string (_ptr, &fs[(offsets >> 34)], (offsets >> (MAX_KEY_BITS + MAX_FEATURE_BITS)) & 0x3ff);
+      for (size_t i = 0; i < iov.size (); ) {
+        const long r = static_cast <long> (::writev (1, &iov[i], static_cast <int> (std::min (iov.size () - i, max_iov))));
+        if (r <= 0) my_errx (1, "%s", "failed to write output");
+        size_t written = static_cast <size_t> (r);
+        for (; i < iov.size () && written >= iov[i].iov_len; ++i) written -= iov[i].iov_len;
+        if (written) { // partially written
+          iov[i].iov_base = static_cast <char*> (iov[i].iov_base) + written;
+          iov[i].iov_len -= written;
+        }
+      }
 #endif
+    }
+    // reader -> num_threads workers -> writer; output is the same as run ()
+    template <const bool POS_TAGGING, typename Reader>
+    void run_parallel (const size_t num_threads, Reader& read) const {
+      block_pipeline pipeline (2 * num_threads + 2);
+      std::thread reader ([&pipeline, &read] {
+        for (bool eof = false; ! eof; ) {
+          block_pipeline::block* b = pipeline.acquire ();
+          eof = read (*b);
+          pipeline.push (b, eof);
+        }
+      });
+      std::vector <std::thread> workers;
+      for (size_t i = 0; i < num_threads; ++i)
+        workers.push_back (std::thread ([this, &pipeline] {
+          char_ids chars;
+          while (block_pipeline::block* b = pipeline.pop ()) {
+            b->used = 0;
+            if (b->len) tag_lines <POS_TAGGING> (b->data, b->data + b->len, b->out, b->used, chars);
+            pipeline.finish (b);
           }
-        write_string (_ptr, POS_TAGGING ? "EOS\n" : "\n", POS_TAGGING ? 4 : 1);
-        write_buffer (_ptr, &_res[0], BUF_SIZE_);
+        }));
+      std::vector <block_pipeline::block*> ready;
+      for (bool last = false; ! last; ) {
+        pipeline.next (ready);
+        write_blocks (ready);
+        for (size_t i = 0; i < ready.size (); ++i) {
+          last = ready[i]->last;
+          pipeline.release (ready[i]);
+        }
+      }
+      reader.join ();
+      for (size_t i = 0; i < workers.size (); ++i) workers[i].join ();
+    }
+    // tag a file (-i); a regular file is mapped and tagged in place, and a
+    // gzip file is decompressed on the reader thread
+    template <const int BUF_SIZE_, const bool POS_TAGGING>
+    void run_file (const std::string& fn, const size_t num_threads) const {
+      const int fd = ::open (fn.c_str (), O_RDONLY);
+      if (fd == -1) my_errx (1, "no such file: %s", fn.c_str ());
+      mapped_file file;
+      if (! file.map (fd) || is_gzip (file.data (), file.size ())) { // pipe, gzip, etc.
+        run_stream <BUF_SIZE_, POS_TAGGING> (fd, num_threads);
+        ::close (fd);
+        return;
+      }
+      ::close (fd); // the mapping stays valid after close ()
+      if (! file.size ()) return;
+      mapped_blocks read (file);
+      if (num_threads > 1) return run_parallel <POS_TAGGING> (num_threads, read);
+      block_pipeline::block b;
+      char_ids chars;
+      for (bool eof = false; ! eof; ) {
+        eof = read (b);
+        b.used = 0;
+        tag_lines <POS_TAGGING> (b.data, b.data + b.len, b.out, b.used, chars);
+        write_block (b);
+      }
+    }
+    // tag input read from fd (stdin or a file that is not mapped)
+    template <const int BUF_SIZE_, const bool POS_TAGGING>
+    void run_stream (const int fd, const size_t num_threads) const {
+      if (num_threads > 1) {
+        stream_blocks read (fd, BUF_SIZE_ != 0);
+        return run_parallel <POS_TAGGING> (num_threads, read);
+      }
+      // extended by the writer for a long line; at least half of it is free
+      // at the beginning of a line
+      std::vector <char> out (BUF_SIZE);
+      char* ptr (&out[0]);
+      const char* line (0);
+      // overlap reading input with tagging if there is a spare core
+      read_ahead reader (fd, BUF_SIZE_ != 0, std::thread::hardware_concurrency () > 1);
+      char_ids chars;
+      mecab_writer <POS_TAGGING> writer (ptr, p2f, fs, &out);
+      while (const size_t len = reader.gets (&line)) {
+        const bool ret (line[len - 1] == '\n');
+        const size_t n = chars.decode (line, line + len - ret, c2i);
+        writer.line = line;
+        writer.bos  = true;
+        tag_line (da, p2f, c2i, chars, n, writer);
+        write_string (ptr, POS_TAGGING ? "EOS\n" : "\n", POS_TAGGING ? 4 : 1);
+        // interactive: flush before waiting for input; lines already read
+        // are written together
+        write_buffer (ptr, &out[0], BUF_SIZE_ || reader.ready () ? (BUF_SIZE >> 1) : 0);
       }
-      write_buffer (_ptr, &_res[0], 0);
+      write_buffer (ptr, &out[0], 0);
+    }
+    template <const int BUF_SIZE_, const bool POS_TAGGING>
+    void run (const size_t num_threads = 1, const std::string& input = "") const {
+      if (! input.empty ()) return run_file <BUF_SIZE_, POS_TAGGING> (input, num_threads);
+      if (BUF_SIZE_ == 0) std::fprintf (stderr, "(input: stdin)\n");
+      run_stream <BUF_SIZE_, POS_TAGGING> (0, num_threads);
     }
   };
 }
 
 int main (int argc, char** argv) {
   std::string model (JAGGER_DEFAULT_MODEL "/patterns");
-  bool tag (true), fbf (false);
+  std::string profile, input;
+  bool tag (true), fbf (false), strict (false);
+  size_t num_threads (1);
 #if 0
   { // options (minimal)
     extern char *optarg;
@@ -367,7 +677,7 @@ int main (int argc, char** argv) {
 #else
   {
     if ((argc < 2) || (std::string(argv[1]) == "-h")) {
-          my_errx (1, "Pattern-based Jappanese Morphological Analyzer\nUsage: %s -m dir [-wf] < input\n\nOptions:\n -m dir\tpattern directory (default: " JAGGER_DEFAULT_MODEL ")\n -w\tperform only segmentation\n -f\tfull buffering (fast but not interactive)", argv[0]);
+          my_errx (1, "Pattern-based Jappanese Morphological Analyzer\nUsage: %s -m dir [-wfs] [-j N] [-i file | < input]\n\nOptions:\n -m dir\tpattern directory (default: " JAGGER_DEFAULT_MODEL ")\n -w\tperform only segmentation\n -f\tfull buffering (fast but not interactive)\n -s\tstrict; fail if the model is not compiled by jagger-compile\n -P file\trecord visits of trie nodes to file (for jagger-compile -P)\n -j N\ttag with N threads (default: 1; 0: # of cores); output is in input order\n -i file\tread file instead of stdin; a regular file is mapped to memory and\n\ttagged without copy\n\ngzip-compressed input is decompressed (if built with zlib)", argv[0]);
 
     }
 
@@ -384,17 +694,55 @@ int main (int argc, char** argv) {
         tag = false;
       } else if (arg == "-f") {
         fbf = true;
+      } else if (arg == "-s") {
+        strict = true;
+      } else if (arg == "-P") {
+        if ((i + 1) >= static_cast <size_t> (argc)) {
+          my_errx(1, "%s: profile filename is missing.\n", argv[0]);
+        }
+        profile = argv[i+1];
+        i++;
+      } else if (arg == "-i") {
+        if ((i + 1) >= static_cast <size_t> (argc)) {
+          my_errx(1, "%s: input filename is missing.\n", argv[0]);
+        }
+        input = argv[i+1];
+        i++;
+      } else if (arg == "-j") {
+        if ((i + 1) >= static_cast <size_t> (argc)) {
+          my_errx(1, "%s: number of threads is missing.\n", argv[0]);
+        }
+        char* num_end (0);
+        errno = 0;
+        const long n = std::strtol (argv[i+1], &num_end, 10);
+        if (num_end == argv[i+1] || *num_end || n < 0 || errno == ERANGE)
+          my_errx(1, "invalid number of threads: %s", argv[i+1]);
+        num_threads = static_cast <size_t> (n);
+        i++;
       }
     }
   }
 #endif
   jagger::tagger jagger;
-  jagger.read_model (model);
+  jagger.read_model (model, strict);
+  if (! profile.empty ()) jagger.profile (profile);
+  const size_t num_cores = std::max (std::thread::hardware_concurrency (), 1u);
+  if (num_threads == 0) num_threads = num_cores;
+  if (num_threads > 4 * num_cores) {
+    std::fprintf (stderr, "jagger: warn: -j %lu is reduced to %lu (4x # of cores)\n",
+                  static_cast <unsigned long> (num_threads), static_cast <unsigned long> (4 * num_cores));
+    num_threads = 4 * num_cores;
+  }
+  if (! profile.empty () && num_threads > 1) {
+    std::fprintf (stderr, "jagger: warn: -P records node visits with a single thread\n");
+    num_threads = 1;
+  }
   switch ((fbf << 4) | tag) {
-    case 0x00: jagger.run <0, false> (); break;
-    case 0x01: jagger.run <0, true> (); break;
-    case 0x10: jagger.run <(BUF_SIZE >> 1), false> (); break;
-    case 0x11: jagger.run <(BUF_SIZE >> 1), true> (); break;
+    case 0x00: jagger.run <0, false> (num_threads, input); break;
+    case 0x01: jagger.run <0, true> (num_threads, input); break;
+    case 0x10: jagger.run <(BUF_SIZE >> 1), false> (num_threads, input); break;
+    case 0x11: jagger.run <(BUF_SIZE >> 1), true> (num_threads, input); break;
   }
+  if (! profile.empty ()) jagger.save_profile (profile);
   return 0;
 }
@@ -0,0 +1,172 @@
+// Jagger -- compile patterns (output of train_jagger) into a model offline
+// Copyright 2023 - Present, Light Transport Entertainment Inc.
+#include "jagger.h"
+
+// node visit counts recorded by jagger -P for the trie da
+static void read_profile (const std::string& fn, const void* da, const size_t nbytes, std::vector <uint64_t>& weights) {
+  std::vector <char> buf;
+  read_file (fn, buf);
+  profile_header h;
+  if (buf.size () < sizeof (h)) my_errx (1, "not a profile: %s", fn.c_str ());
+  std::memcpy (&h, &buf[0], sizeof (h));
+  if (std::memcmp (h.magic, "JAGGERP", 8) != 0 || buf.size () != sizeof (h) + h.da_nodes * sizeof (uint32_t))
+    my_errx (1, "not a profile: %s", fn.c_str ());
+  if (h.da_nodes * sizeof (ccedar::da_::node) != nbytes || h.da_digest != da_digest (da, nbytes))
+    my_errx (1, "profile is recorded with another model: %s", fn.c_str ());
+  weights.resize (h.da_nodes);
+  for (size_t i = 0; i < weights.size (); ++i) {
+    uint32_t count (0);
+    std::memcpy (&count, &buf[sizeof (h) + i * sizeof (uint32_t)], sizeof (uint32_t));
+    weights[i] = count;
+  }
+}
+
+// re-layout the trie of a compiled model (m.da or m.jgm) and/or add a hot
+// core built from a profile into output; the POS-context table is rebuilt
+static void update_model (model_compiler& compiler, const std::string& m, const std::string& output, const bool re, const std::string& profile) {
+  const bool jgm = m.size () > 4 && m.compare (m.size () - 4, 4, ".jgm") == 0;
+  std::vector <char> buf;
+  read_file (jgm ? m : m + ".da", buf);
+  packed_model pm;
+  size_t size (buf.size ());
+  const void* da = &buf[0];
+  if (jgm) {
+    if (const char* err = pm.open (&buf[0], buf.size ()))
+      my_errx (1, "%s", (m + ": " + err).c_str ());
+    if (! (da = pm.section (JGM_DA, size)))
+      my_errx (1, "missing section in packed model: %s", m.c_str ());
+  }
+  if (! profile.empty ()) {
+    std::vector <uint64_t> weights;
+    read_profile (profile, da, size, weights);
+    build_hot (da, size, weights, compiler.hot_budget, compiler.hot);
+  }
+  if (re) {
+    compiler.relayout (da, size);
+    da = compiler.da.array ();
+    size = compiler.da_bytes ();
+  }
+  std::vector <char> p2f_buf, c2i_buf, is_pos;
+  size_t p2f_size (0), c2i_size (0);
+  const void* p2f = 0;
+  c2i_map c2i;
+  if (jgm) {
+    p2f = pm.section (JGM_P2F, p2f_size);
+    if (const void* p = pm.section (JGM_C2I_PAGED, c2i_size)) {
+      if (! c2i.set_array (p, c2i_size)) my_errx (1, "corrupted character mapping: %s", m.c_str ());
+    } else if (const void* q = pm.section (JGM_C2I, c2i_size)) {
+      c2i.build (static_cast <const uint16_t*> (q), c2i_size / sizeof (uint16_t));
+    }
+    if (! p2f || ! c2i.size ()) my_errx (1, "missing section in packed model: %s", m.c_str ());
+  } else {
+    read_file (m + ".p2f", p2f_buf);
+    read_file (m + ".c2i", c2i_buf);
+    p2f = &p2f_buf[0];
+    p2f_size = p2f_buf.size ();
+    c2i.build (reinterpret_cast <const uint16_t*> (&c2i_buf[0]), c2i_buf.size () / sizeof (uint16_t));
+  }
+  pos_labels (static_cast <const uint64_t*> (p2f), p2f_size / sizeof (uint64_t), c2i[CP_MAX + 1], is_pos);
+  build_pos_table (da, size, is_pos, compiler.pos);
+  if (! jgm) {
+    if (output != m) { // copy the rest of the model
+      std::vector <char> fs_buf;
+      read_file (m + ".fs", fs_buf);
+      write_file_atomic (&fs_buf[0], fs_buf.size (), output + ".fs");
+      write_file_atomic (&p2f_buf[0], p2f_buf.size (), output + ".p2f");
+      write_file_atomic (&c2i_buf[0], c2i_buf.size (), output + ".c2i");
+    }
+    if (compiler.pos.empty ())
+      std::remove ((output + ".pos").c_str ()); // no POS-context patterns
+    else
+      write_file_atomic (&compiler.pos[0], compiler.pos.size (), output + ".pos");
+    if (! compiler.hot.empty ())
+      write_file_atomic (&compiler.hot[0], compiler.hot.size (), output + ".hot");
+    else if (re)
+      std::remove ((output + ".hot").c_str ()); // built for the old trie
+    if (re || output != m)
+      write_file_atomic (da, size, output + ".da");
+    return;
+  }
+  static const uint32_t ids[] = {JGM_C2I, JGM_C2I_PAGED, JGM_P2F, JGM_FS};
+  packed_model_writer writer;
+  writer.add (JGM_DA, da, size);
+  for (size_t i = 0; i < sizeof (ids) / sizeof (ids[0]); ++i)
+    if (const void* p = pm.section (ids[i], size))
+      writer.add (ids[i], p, size);
+  if (! compiler.pos.empty ())
+    writer.add (JGM_POS, &compiler.pos[0], compiler.pos.size ());
+  if (! compiler.hot.empty ())
+    writer.add (JGM_HOT, &compiler.hot[0], compiler.hot.size ());
+  else if (const void* p = re ? 0 : pm.section (JGM_HOT, size))
+    writer.add (JGM_HOT, p, size);
+  const uint64_t fingerprint = writer.save (output + ".jgm");
+  std::fprintf (stderr, "%s.jgm: fingerprint %016llx\n", output.c_str (),
+                static_cast <unsigned long long> (fingerprint));
+}
+
+int main (int argc, char** argv) {
+  std::string patterns, output;
+  std::string profile;
+  bool packed (false), verbose (true), re (false), update (false);
+  int layout = model_compiler::builder_t::WEIGHTED;
+  size_t hot_budget = 0;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg (argv[i]);
+    if (arg == "-p") {
+      packed = true;
+    } else if (arg == "-q") {
+      verbose = false;
+    } else if (arg == "-r") {
+      re = true;
+    } else if (arg == "-u") {
+      update = true;
+    } else if (arg == "-H" && i + 1 < argc) {
+      hot_budget = std::strtoul (argv[++i], 0, 10);
+    } else if (arg == "-P" && i + 1 < argc) {
+      profile = argv[++i];
+    } else if (arg == "-l" && i + 1 < argc) {
+      const std::string order (argv[++i]);
+      if (order == "dfs")       layout = model_compiler::builder_t::DFS;
+      else if (order == "bfs")  layout = model_compiler::builder_t::BFS;
+      else if (order == "freq") layout = model_compiler::builder_t::WEIGHTED;
+      else my_errx (1, "unknown layout: %s", order.c_str ());
+    } else if (arg == "-h" || (! arg.empty () && arg[0] == '-')) {
+      patterns.clear ();
+      break;
+    } else if (patterns.empty ()) {
+      patterns = arg;
+    } else {
+      output = arg;
+    }
+  }
+  if (patterns.empty ())
+    my_errx (1, "%s", (std::string ("Compile Jagger patterns into a model\nUsage: ") + argv[0] + " [-pq] [-l order] [-H nodes] patterns [output]\n       " + argv[0] + " -u [-r] [-l order] [-H nodes] [-P profile] model [output]\n\nOptions:\n -p\twrite a single packed model (output.jgm) instead of .da/.c2i/.p2f/.fs\n -q\tdo not report progress\n -l order\torder of placing trie nodes: freq (default; by pattern counts), bfs, dfs\n -u\tupdate a compiled model (model.da or model.jgm) with the POS-context table\n\t(implied by -r and -P)\n -r\tre-layout the trie of a compiled model (model.da or model.jgm) in bfs/dfs order\n -H nodes\tbuild a hot core of the trie with the given # nodes (output.hot or in .jgm);\n\tpatterns are weighted by their counts\n -P profile\tbuild the hot core of a compiled model from node visits recorded by\n\tjagger -P (default -H: 32768)\n\noutput is the model prefix (default: patterns); when it ends with '/',\nthe file name of patterns is appended (e.g., out/ -> out/patterns).\nMissing directories are created. Files are written to temporary files and\nrenamed one by one; use -p to replace a model in use atomically.").c_str ());
+  if (output.empty ()) {
+    output = patterns;
+  } else if (output[output.size () - 1] == '/' || output[output.size () - 1] == '\\') {
+    const size_t pos = patterns.find_last_of ("/\\");
+    output += pos == std::string::npos ? patterns : patterns.substr (pos + 1);
+  }
+  make_dirs (output);
+  model_compiler compiler (verbose, layout);
+  compiler.hot_budget = hot_budget;
+  if (re && ! profile.empty ())
+    my_errx (1, "%s", "-P cannot be used with -r; the profile refers to the current trie");
+  if (update || re || ! profile.empty ()) {
+    if (! compiler.hot_budget) compiler.hot_budget = 1 << 15;
+    if (output.size () > 4 && output.compare (output.size () - 4, 4, ".jgm") == 0)
+      output.resize (output.size () - 4);
+    update_model (compiler, patterns, output, re, profile);
+    return 0;
+  }
+  compiler.compile (patterns);
+  if (packed) {
+    const uint64_t fingerprint = compiler.save_packed (output + ".jgm");
+    if (verbose)
+      std::fprintf (stderr, "%s.jgm: fingerprint %016llx\n", output.c_str (),
+                    static_cast <unsigned long long> (fingerprint));
+  } else {
+    compiler.save (output);
+  }
+  return 0;
+}
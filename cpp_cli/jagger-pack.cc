@@ -0,0 +1,56 @@
+// Jagger -- pack a compiled model (.da / .c2i / .p2f / .fs) into a single .jgm file
+// Copyright 2023 - Present, Light Transport Entertainment Inc.
+#include "jagger.h"
+
+int main (int argc, char** argv) {
+  if (argc < 2 || std::string (argv[1]) == "-h")
+    my_errx (1, "%s", (std::string ("Pack a compiled Jagger model into a single file\nUsage: ") + argv[0] + " model/kwdlc/patterns [output]\n       " + argv[0] + " -v model.jgm\n\nOptions:\n -v\tverify the fingerprint of a packed model\n\nThe default output is <model>.jgm, which the tagger prefers to the loose files.").c_str ());
+  if (std::string (argv[1]) == "-v") {
+    if (argc < 3) my_errx (1, "%s: packed model filename is missing.", argv[0]);
+    std::vector <char> buf;
+    read_file (argv[2], buf);
+    packed_model pm;
+    if (const char* err = pm.open (&buf[0], buf.size ()))
+      my_errx (1, "%s", (std::string (argv[2]) + ": " + err).c_str ());
+    if (! pm.verify ())
+      my_errx (1, "fingerprint mismatch: %s", argv[2]);
+    std::fprintf (stderr, "%s: OK (fingerprint %016llx)\n", argv[2],
+                  static_cast <unsigned long long> (pm.fingerprint ()));
+    return 0;
+  }
+  const std::string m (argv[1]), out (argc > 2 ? argv[2] : m + ".jgm");
+  static const char* exts[] = {".da", ".c2i", ".p2f", ".fs"};
+  static const uint32_t ids[] = {JGM_DA, JGM_C2I, JGM_P2F, JGM_FS};
+  std::vector <char> bufs[4];
+  std::vector <uint16_t> c2i_paged;
+  packed_model_writer writer;
+  for (size_t i = 0; i < 4; ++i) {
+    read_file (m + exts[i], bufs[i]);
+    if (ids[i] == JGM_C2I) { // store the compact paged mapping instead of the flat table
+      c2i_map::serialize (reinterpret_cast <const uint16_t*> (&bufs[i][0]), bufs[i].size () / sizeof (uint16_t), c2i_paged);
+      writer.add (JGM_C2I_PAGED, &c2i_paged[0], c2i_paged.size () * sizeof (uint16_t));
+    } else
+      writer.add (ids[i], &bufs[i][0], bufs[i].size ());
+  }
+  // POS-context table for the trie (rebuilt; m.pos may be stale)
+  std::vector <char> is_pos, pos, hot;
+  const uint16_t* c2i = reinterpret_cast <const uint16_t*> (&bufs[1][0]);
+  if (bufs[1].size () / sizeof (uint16_t) <= CP_MAX + 1)
+    my_errx (1, "corrupted character mapping: %s", (m + ".c2i").c_str ());
+  pos_labels (reinterpret_cast <const uint64_t*> (&bufs[2][0]), bufs[2].size () / sizeof (uint64_t), c2i[CP_MAX + 1], is_pos);
+  build_pos_table (&bufs[0][0], bufs[0].size (), is_pos, pos);
+  if (! pos.empty ()) writer.add (JGM_POS, &pos[0], pos.size ());
+  if (FILE* fp = std::fopen ((m + ".hot").c_str (), "rb")) { // hot core, if any
+    std::fclose (fp);
+    read_file (m + ".hot", hot);
+    ccedar::hot_da h;
+    if (h.set_image (&hot[0], hot.size (), &bufs[0][0], bufs[0].size ()))
+      writer.add (JGM_HOT, &hot[0], hot.size ());
+    else
+      std::fprintf (stderr, "jagger: warn: ignore %s.hot built for another trie\n", m.c_str ());
+  }
+  const uint64_t fingerprint = writer.save (out);
+  std::fprintf (stderr, "%s: packed (fingerprint %016llx)\n", out.c_str (),
+                static_cast <unsigned long long> (fingerprint));
+  return 0;
+}
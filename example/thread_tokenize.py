@@ -0,0 +1,29 @@
+import sys
+from concurrent.futures import ThreadPoolExecutor
+
+import jagger
+
+model_path = "model/kwdlc/patterns"
+
+tokenizer = jagger.Jagger()
+tokenizer.load_model(model_path)
+
+texts = [
+    "吾輩は猫である。名前はまだない。",
+    "明日の天気は晴れです。",
+    "どこで生れたかとんと見当がつかぬ。",
+] * 1000
+
+# `tokenize` releases the GIL while tagging, so Python threads sharing one
+# tokenizer run on multiple CPU cores.
+expected = [[(tok.surface(), tok.feature()) for tok in tokenizer.tokenize(text)] for text in texts]
+
+with ThreadPoolExecutor(max_workers=4) as pool:
+    results = list(pool.map(tokenizer.tokenize, texts))
+
+for toks, exp in zip(results, expected):
+    if [(tok.surface(), tok.feature()) for tok in toks] != exp:
+        print("Result mismatch in threads")
+        sys.exit(1)
+
+print("OK: {} texts tokenized in 4 threads".format(len(texts)))
@@ -17,21 +17,40 @@ class Jagger:
 
         self._tagger = JaggerExt()
 
-    def load_model(self, dict_path: Path):
-        self._tagger.load_model(str(dict_path))
+    def load_model(self, dict_path: Path, strict: bool = False):
+        # strict: do not compile patterns when the model is not compiled yet(use `jagger-compile`)
+        return self._tagger.load_model(str(dict_path), strict)
 
     def tokenize(self, s: str):
         return self._tagger.tokenize(s)
 
-    def tokenize_batch(self, s: str):
-        if isinstance(s, list):
-            s = '\n'.join(s)
-            # strip redundant '\n'(if input is a list of text which endswith '\n'
-            s.replace('\n\n', '\n')
+    def tokenize_batch(self, s, lazy: bool = False):
+        # s: str, list of lines(str or bytes; tokens are returned for each
+        # item), or UTF-8 bytes-like object(bytes, memoryview, mmap, ...)
+        # returns a list of lists of tokens, or with lazy=True, a sequence
+        # whose token objects are created on access(see README)
+        res = self._tagger.tokenize_batch(s)
+        return res if lazy else res.to_list()
 
-        return self._tagger.tokenize_batch(s)
+    def tokenize_file(self, path: Path, lazy: bool = False):
+        # UTF-8 text file(gzip-compressed one is decompressed if built with
+        # zlib); returns tokens of each line as tokenize_batch
+        res = self._tagger.tokenize_file(str(path))
+        return res if lazy else res.to_list()
+
+    def tokenize_batch_arrays(self, s):
+        # tokens in flat arrays(numpy.asarray() to get ndarray without copy);
+        # see README
+        return self._tagger.tokenize_batch_arrays(s)
+
+    def feature_table(self, concat: bool = False):
+        return self._tagger.feature_table(concat)
 
     def set_threads(self, n: int):
         return self._tagger.set_threads(n)
 
+    def set_split_threshold(self, nbytes: int):
+        # lines of nbytes or longer are tagged with multiple threads(0: never)
+        return self._tagger.set_split_threshold(nbytes)
+
 
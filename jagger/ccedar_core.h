@@ -7,6 +7,10 @@
 #include <cstdlib>
 #include <cstring>
 #include <vector>
+#include <algorithm>
+#include <utility>
+#include <deque>
+#include <stdint.h>
 
 namespace ccedar {
   // typedefs
@@ -132,6 +136,7 @@ namespace ccedar {
       //_no_delete = true;
     }
     const void* array () const { return _array.data(); }
+    size_t size () const { return static_cast <size_t> (_size); }
     void clear (const bool reuse = true) {
       //if (_array && ! _no_delete) std::free (_array);
       //if (_ninfo) std::free (_ninfo);
@@ -406,5 +411,309 @@ namespace ccedar {
       return flag ? base ^ label_n : to_pn;
     }
   };
+  // frozen (read-only) double array; refers to an image saved by da::save ()
+  // such as an mmap-ed file. it holds only base/check, no update machinery.
+  template <typename key_type,
+            typename value_type,
+            const int NO_VALUE  = -1,
+            const int NO_PATH   = -2>
+  class frozen_da {
+  public:
+    enum error_code { CEDAR_NO_VALUE = NO_VALUE, CEDAR_NO_PATH = NO_PATH };
+    typedef typename to_unsigned <key_type>::type ukey_type;
+    typedef value_type result_type;
+    struct node { // same layout as da::node
+      union { int base; value_type value; };
+      int  check;
+    };
+    frozen_da () : _array (0), _size (0) {}
+    frozen_da (const void* p, size_t nbytes_) : _array (0), _size (0)
+    { set_array (p, nbytes_); }
+    // no copy is made; the caller must keep p alive
+    void set_array (const void* p, size_t nbytes_) {
+      _array = static_cast <const node*> (p);
+      _size  = nbytes_ / sizeof (node);
+    }
+    const void* array () const { return _array; }
+    size_t size () const { return _size; }
+    template <typename T>
+    T exactMatchSearch (const key_type* key) const
+    { return exactMatchSearch <T> (key, key_len <key_type> (key)); }
+    template <typename T>
+    T exactMatchSearch (const key_type* key, size_t len, size_t from = 0) const {
+      union { int i; value_type x; } b;
+      size_t pos = 0;
+      b.i = _find (key, from, pos, len);
+      if (b.i == CEDAR_NO_PATH) b.i = CEDAR_NO_VALUE;
+      return static_cast <T> (b.x);
+    }
+    value_type traverse (const key_type* key, size_t& from, size_t& pos) const
+    { return traverse (key, from, pos, key_len <key_type> (key)); }
+    value_type traverse (const key_type* key, size_t& from, size_t& pos, size_t len) const {
+      union { int i; value_type x; } b;
+      b.i = _find (key, from, pos, len);
+      return b.x;
+    }
+  protected:
+    const node* _array;
+    size_t      _size;
+    // follow one edge; returns false (and keeps from) if there is no path
+    bool _follow (size_t& from, const ukey_type label) const {
+      const size_t to = static_cast <size_t> (_array[from].base) ^ label;
+      if (_array[to].check != static_cast <int> (from)) return false;
+      from = to;
+      return true;
+    }
+    // value stored at node from; CEDAR_NO_VALUE if from is not a key
+    int _value (const size_t from) const {
+      const node n = _array[_array[from].base ^ 0];
+      return n.check == static_cast <int> (from) ? n.base : CEDAR_NO_VALUE;
+    }
+    int _find (const key_type* key, size_t& from, size_t& pos, const size_t len) const {
+      for (const ukey_type* const key_ = reinterpret_cast <const ukey_type*> (key);
+           pos < len; ++pos)
+        if (! _follow (from, key_[pos])) return CEDAR_NO_PATH;
+      return _value (from);
+    }
+  };
+  // static double array builder; lays out the children of each node at once
+  // from sorted keys. the image is compatible with da::save () / frozen_da.
+  template <typename key_type,
+            typename value_type,
+            const int MAX_KEY_BITS = sizeof (key_type) * 8,
+            const int MAX_TRIAL = 8>
+  class da_builder {
+  public:
+    enum { MAX_KEY_CODE = 1 << MAX_KEY_BITS };
+    typedef typename to_unsigned <key_type>::type ukey_type;
+    typedef typename frozen_da <key_type, value_type>::node node;
+    typedef std::vector <ukey_type> key_t;
+    typedef std::vector <std::pair <key_t, value_type> > keys_t;
+    enum { DFS = 0, BFS = 1, WEIGHTED = 2 }; // order of placing nodes
+    da_builder () : _array (), _weight (), _used (), _next (), _prev (), _block (), _open (), _closed () {}
+    // for duplicated keys the last one wins as da::update () = value does.
+    // labels must be non-zero (0: terminal). nodes are placed in the given
+    // order; BFS packs the top levels of the trie into the first few pages,
+    // WEIGHTED places nodes in descending order of the sum of weights (e.g.,
+    // pattern counts; default: 1) of the keys below them, which approximates
+    // how often they are visited
+    void build (const keys_t& keys, const int order = DFS, const std::vector <uint64_t>* weights = 0) {
+      clear ();
+      std::vector <size_t> idx (keys.size ());
+      for (size_t i = 0; i < idx.size (); ++i) idx[i] = i;
+      std::stable_sort (idx.begin (), idx.end (), _key_less (keys));
+      size_t n = 0; // dedup (keep the last one)
+      for (size_t i = 0; i < idx.size (); ++i) {
+        if (n && keys[idx[n - 1]].first == keys[idx[i]].first) --n;
+        idx[n++] = idx[i];
+      }
+      idx.resize (n);
+      std::vector <uint64_t> acc (n + 1, 0); // prefix sums of weights
+      for (size_t i = 0; i < n; ++i)
+        acc[i + 1] = acc[i] + (weights ? (*weights)[idx[i]] : 1);
+      _add_block ();
+      _pop_enode (0); // root
+      if (keys.empty ()) { _array[0].base = 0; return; }
+      std::deque <_range> queue (1, _range (0, 0, n, 0, acc[n]));
+      std::vector <ukey_type> labels;
+      std::vector <_range> children;
+      while (! queue.empty ()) {
+        _range r = queue.back ();
+        if (order == BFS) {
+          r = queue.front ();
+          queue.pop_front ();
+        } else if (order == DFS) {
+          queue.pop_back ();
+        } else {
+          std::pop_heap (queue.begin (), queue.end (), _lighter);
+          r = queue.back ();
+          queue.pop_back ();
+        }
+        labels.clear ();
+        children.clear ();
+        for (size_t i = r.begin; i < r.end; ) {
+          const key_t& key = keys[idx[i]].first;
+          if (key.size () == r.depth) { // terminal
+            labels.push_back (0);
+            children.push_back (_range (0, i, i + 1, r.depth, 0));
+            ++i;
+            continue;
+          }
+          const ukey_type label = key[r.depth];
+          size_t j = i + 1;
+          while (j < r.end && keys[idx[j]].first[r.depth] == label) ++j;
+          labels.push_back (label);
+          children.push_back (_range (0, i, j, r.depth + 1, acc[j] - acc[i]));
+          i = j;
+        }
+        const int base = _find_base (&labels[0], &labels[0] + labels.size () - 1);
+        _array[r.node].base = base;
+        _weight[r.node] = r.weight;
+        for (size_t k = 0; k < labels.size (); ++k) {
+          const int to = base ^ static_cast <int> (labels[k]);
+          _pop_enode (to);
+          _array[to].check = static_cast <int> (r.node);
+          if (labels[k]) {
+            children[k].node = static_cast <size_t> (to);
+          } else {
+            _array[to].value = keys[idx[children[k].begin]].second;
+          }
+        }
+        if (order == DFS) {
+          for (size_t k = labels.size (); k-- > 0; ) // keep the label order
+            if (labels[k]) queue.push_back (children[k]);
+        } else
+          for (size_t k = 0; k < labels.size (); ++k)
+            if (labels[k]) {
+              queue.push_back (children[k]);
+              if (order == WEIGHTED) std::push_heap (queue.begin (), queue.end (), _lighter);
+            }
+      }
+    }
+    // keys and values in a double array image (e.g., da::save () / build ());
+    // pass them to build () to re-layout a compiled trie
+    static void extract (const node* array, const size_t size, keys_t& keys) {
+      if (! size) return;
+      std::vector <size_t> head, child;
+      children (array, size, head, child);
+      std::vector <std::pair <size_t, size_t> > stack (1, std::make_pair (0, 0)); // (node, depth)
+      key_t key;
+      while (! stack.empty ()) {
+        const size_t from = stack.back ().first;
+        key.resize (stack.back ().second);
+        stack.pop_back ();
+        if (from) {
+          const ukey_type label = static_cast <ukey_type> (array[array[from].check].base ^ static_cast <int> (from));
+          if (! label) { // terminal
+            keys.push_back (std::make_pair (key, array[from].value));
+            continue;
+          }
+          key.push_back (label);
+        }
+        for (size_t i = head[from]; i < head[from + 1]; ++i)
+          stack.push_back (std::make_pair (child[i], key.size ()));
+      }
+    }
+    // children of node e in a double array image are child[head[e]..head[e + 1])
+    static void children (const node* array, const size_t size, std::vector <size_t>& head, std::vector <size_t>& child) {
+      head.assign (size + 1, 0);
+      child.assign (size, 0);
+      for (size_t e = 1; e < size; ++e)
+        if (array[e].check >= 0) ++head[static_cast <size_t> (array[e].check) + 1];
+      for (size_t i = 0; i < size; ++i) head[i + 1] += head[i];
+      std::vector <size_t> tail (head.begin (), head.end () - 1);
+      for (size_t e = 1; e < size; ++e)
+        if (array[e].check >= 0) child[tail[static_cast <size_t> (array[e].check)]++] = e;
+    }
+    const void* array () const { return _array.empty () ? 0 : &_array[0]; }
+    size_t size () const { return _array.size (); }
+    // weight of each node given to build () (0 for terminals and empty nodes)
+    const std::vector <uint64_t>& weights () const { return _weight; }
+    int save (const char* fn, const char* mode = "wb") const {
+      FILE* fp = std::fopen (fn, mode);
+      if (! fp) return -1;
+      std::fwrite (array (), sizeof (node), _array.size (), fp);
+      std::fclose (fp);
+      return 0;
+    }
+    void clear () {
+      _array.clear (); _weight.clear (); _used.clear (); _next.clear (); _prev.clear ();
+      _block.clear (); _open.clear (); _closed.clear ();
+    }
+  private:
+    struct _range { // keys [begin, end) below node
+      size_t node, begin, end, depth;
+      uint64_t weight;
+      _range (size_t node_, size_t begin_, size_t end_, size_t depth_, uint64_t weight_) : node (node_), begin (begin_), end (end_), depth (depth_), weight (weight_) {}
+    };
+    static bool _lighter (const _range& a, const _range& b) // ties: key order
+    { return a.weight < b.weight || (a.weight == b.weight && a.begin > b.begin); }
+    struct block { // same policy as da: Open -> Closed (after MAX_TRIAL) -> Full
+      int num;   // # empty elements
+      int ok;    // # children that may still fit
+      int trial; // # failed trials
+      int ehead; // first empty element
+      int state; // 0: Open, 1: Closed, 2: Full
+      block () : num (MAX_KEY_CODE), ok (MAX_KEY_CODE), trial (0), ehead (0), state (0) {}
+    };
+    std::vector <node>  _array;
+    std::vector <uint64_t> _weight;
+    std::vector <char>  _used;
+    std::vector <int>   _next; // ring of empty elements in each block
+    std::vector <int>   _prev;
+    std::vector <block> _block;
+    std::vector <int>   _open;   // blocks for nodes w/ >= 2 children
+    std::vector <int>   _closed; // blocks for nodes w/ a single child
+    struct _key_less {
+      const keys_t& keys;
+      _key_less (const keys_t& keys_) : keys (keys_) {}
+      bool operator() (const size_t a, const size_t b) const { return keys[a].first < keys[b].first; }
+    };
+    int _add_block () {
+      const int bi = static_cast <int> (_block.size ());
+      const int e = bi << MAX_KEY_BITS;
+      node n; n.base = 0; n.check = -1; // empty
+      _array.resize (_array.size () + MAX_KEY_CODE, n);
+      _weight.resize (_array.size (), 0);
+      _used.resize (_array.size (), 0);
+      _next.resize (_array.size ());
+      _prev.resize (_array.size ());
+      for (int i = 0; i < MAX_KEY_CODE; ++i) {
+        _next[e + i] = e + (i + 1) % MAX_KEY_CODE;
+        _prev[e + i] = e + (i + MAX_KEY_CODE - 1) % MAX_KEY_CODE;
+      }
+      _block.push_back (block ());
+      _block.back ().ehead = e;
+      _open.push_back (bi);
+      return bi;
+    }
+    static void _remove (std::vector <int>& v, const int bi)
+    { v.erase (std::find (v.begin (), v.end (), bi)); }
+    void _pop_enode (const int e) { // mark e as used
+      block& b = _block[e >> MAX_KEY_BITS];
+      _used[e] = 1;
+      if (--b.num == 0) {
+        _remove (b.state ? _closed : _open, e >> MAX_KEY_BITS);
+        b.state = 2;
+        return;
+      }
+      _next[_prev[e]] = _next[e];
+      _prev[_next[e]] = _prev[e];
+      if (e == b.ehead) b.ehead = _next[e];
+      if (b.state == 0 && b.num == 1) { // Open to Closed
+        _remove (_open, e >> MAX_KEY_BITS);
+        _closed.push_back (e >> MAX_KEY_BITS);
+        b.state = 1;
+      }
+    }
+    // base for children labels [first, last]
+    int _find_base (const ukey_type* const first, const ukey_type* const last) {
+      if (first == last) { // single child; use any empty element
+        const int bi = ! _closed.empty () ? _closed.front () : ! _open.empty () ? _open.front () : _add_block ();
+        return _block[bi].ehead ^ static_cast <int> (*first);
+      }
+      const int nc = static_cast <int> (last - first + 1);
+      for (size_t k = 0; k < _open.size (); ) {
+        const int bi = _open[k];
+        block& b = _block[bi];
+        if (b.num >= nc && nc <= b.ok)
+          for (int e = b.ehead;;) {
+            const int base = e ^ static_cast <int> (*first);
+            const ukey_type* p = first + 1;
+            while (p <= last && ! _used[base ^ static_cast <int> (*p)]) ++p;
+            if (p > last) { b.ehead = e; return base; } // no conflict
+            if ((e = _next[e]) == b.ehead) break;
+          }
+        b.ok = nc - 1;
+        if (++b.trial == MAX_TRIAL) { // Open to Closed
+          _open.erase (_open.begin () + static_cast <long> (k));
+          _closed.push_back (bi);
+          b.state = 1;
+        } else
+          ++k;
+      }
+      return _add_block () << MAX_KEY_BITS; // children fit in an empty block
+    }
+  };
 }
 #endif
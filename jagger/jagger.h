@@ -16,11 +16,11 @@
 
 #if !defined(_WIN32)
 #include <unistd.h>
+#include <sys/stat.h>
 #endif
 
 #if defined(JAGGER_USE_MMAP_IO)
 #if !defined(_WIN32)
-#include <sys/stat.h>
 #include <sys/mman.h>
 //#include <err.h>
 #endif
@@ -31,12 +31,25 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cerrno>
 #include <cassert>
 #include <iterator>
 #include <vector>
 #include <string>
 #include <map>
 #include <algorithm>
+#include <chrono>
+
+// SSE / AVX2 kernels picked at run time (u8_decoder (), line_break_finder ())
+#if ! defined(JAGGER_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define JAGGER_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// gzip-compressed input (input_stream)
+#if defined(JAGGER_WITH_ZLIB)
+#include <zlib.h>
+#endif
 
 //
 #include "ccedar_core.h"
@@ -67,6 +80,8 @@ static void my_errx(int retcode, const char *fmt, const char *s)
 static const size_t BUF_SIZE = 1 << 18;
 static const size_t CP_MAX   = 0x10ffff;
 static const size_t MAX_PLEN = 1 << 6;
+static const size_t MAX_KEY_BITS     = 14;
+static const size_t MAX_FEATURE_BITS = 7;
 
 static const char* FEAT_UNK = "\x09\xE5\x90\x8D\xE8\xA9\x9E\x2C\xE6\x99\xAE\xE9\x80\x9A\xE5\x90\x8D\xE8\xA9\x9E\x2C\x2A\x2C\x2A";
 
@@ -114,6 +129,510 @@ static const char* skip_to (const char* p, const size_t n, const char c) {
   return p;
 }
 
+static inline uint64_t fnv1a64 (const void* p, size_t n, uint64_t h = 0xcbf29ce484222325ull) {
+  for (const unsigned char *q = static_cast <const unsigned char*> (p), *const end = q + n; q != end; ++q)
+    h = (h ^ *q) * 0x100000001b3ull;
+  return h;
+}
+
+// cheap digest of a trie image (its size and first block) to tie the arrays
+// derived from a trie (hot core, profile) to it
+static inline uint64_t da_digest (const void* array, const size_t nbytes) {
+  const uint64_t n = nbytes;
+  return fnv1a64 (&n, sizeof (n), fnv1a64 (array, std::min (nbytes, static_cast <size_t> (8) << MAX_KEY_BITS)));
+}
+
+// two-level mapping from code point to character ID; replaces the flat table
+// of CP_MAX + 2 entries (2.2MB), of which real text touches only a few pages
+//   [index: NUM_PAGES x uint16_t][page 0 (all zero)][page 1][page 2]...
+// pages of code points w/o any character ID share the zero page
+class c2i_map {
+public:
+  enum { PAGE_BITS = 8,
+         PAGE_SIZE = 1 << PAGE_BITS,
+         NUM_PAGES = ((CP_MAX + 1) >> PAGE_BITS) + 1 }; // up to BOS (CP_MAX + 1)
+private:
+  const uint16_t* _index;
+  const uint16_t* _pages;
+  const uint16_t* _latin; // U+0000-00FF
+  const uint16_t* _kana;  // U+3000-30FF (CJK punctuation, hiragana, katakana)
+  size_t _size;
+  std::vector <uint16_t> _buf; // own image built from a flat table
+  c2i_map (const c2i_map&);
+  c2i_map& operator= (const c2i_map&);
+public:
+  c2i_map () : _index (0), _pages (0), _latin (0), _kana (0), _size (0), _buf () {}
+  uint16_t operator[] (const size_t u) const {
+    if (u < PAGE_SIZE)          return _latin[u];
+    if (u - 0x3000 < PAGE_SIZE) return _kana[u - 0x3000];
+    if (u >> PAGE_BITS >= NUM_PAGES) return 0; // malformed 4-byte sequence
+    return _pages[(static_cast <size_t> (_index[u >> PAGE_BITS]) << PAGE_BITS) | (u & (PAGE_SIZE - 1))];
+  }
+  // refer to a serialized image (e.g., mmap-ed section); false if malformed
+  bool set_array (const void* p, const size_t nbytes) {
+    const size_t num_pages = nbytes / sizeof (uint16_t) < NUM_PAGES ? 0 : (nbytes / sizeof (uint16_t) - NUM_PAGES) / PAGE_SIZE;
+    if (nbytes != (NUM_PAGES + num_pages * PAGE_SIZE) * sizeof (uint16_t) || ! num_pages)
+      return false;
+    const uint16_t* index = static_cast <const uint16_t*> (p);
+    for (size_t i = 0; i < NUM_PAGES; ++i)
+      if (index[i] >= num_pages) return false;
+    _index = index;
+    _pages = index + NUM_PAGES;
+    _latin = &_pages[static_cast <size_t> (_index[0]) << PAGE_BITS];
+    _kana  = &_pages[static_cast <size_t> (_index[0x3000 >> PAGE_BITS]) << PAGE_BITS];
+    _size  = nbytes;
+    return true;
+  }
+  // build an own image from a flat table (.c2i)
+  void build (const uint16_t* flat, const size_t n) {
+    std::vector <uint16_t> buf;
+    serialize (flat, n, buf);
+    _buf.swap (buf);
+    set_array (&_buf[0], _buf.size () * sizeof (uint16_t));
+  }
+  const void* array () const { return _index; }
+  size_t size () const { return _size; } // in bytes
+  static void serialize (const uint16_t* flat, const size_t n, std::vector <uint16_t>& ret) {
+    ret.assign (NUM_PAGES + PAGE_SIZE, 0); // index + zero page
+    for (size_t i = 0; i < NUM_PAGES; ++i) {
+      const size_t beg = i << PAGE_BITS, end = std::min (beg + PAGE_SIZE, n);
+      size_t u = beg;
+      while (u < end && ! flat[u]) ++u;
+      if (u >= end) continue; // empty page
+      ret[i] = static_cast <uint16_t> ((ret.size () - NUM_PAGES) >> PAGE_BITS);
+      ret.resize (ret.size () + PAGE_SIZE, 0);
+      std::copy (flat + beg, flat + end, ret.end () - PAGE_SIZE);
+    }
+  }
+};
+
+// decode UTF-8 characters in [p, end) into code points cp and byte offsets off
+// (from line) at once; returns # characters. The vector kernels take runs of
+// ASCII and of 3-byte characters (kana, kanji) and leave the rest to unicode (),
+// so all the kernels return the same. cp and off need 32 entries of slack.
+typedef size_t (*u8_decoder_t) (const char* p, const char* end, const char* line, uint32_t* cp, uint32_t* off);
+
+static inline void u8_decode_char (const char*& p, const char* end, const char* line, uint32_t*& cp, uint32_t*& off) {
+  int b (0);
+  char tail[4] = {0, 0, 0, 0}; // unicode () reads 4 bytes
+  const char* q = end - p >= 4 ? p : static_cast <const char*> (std::memcpy (tail, p, static_cast <size_t> (end - p)));
+  *off++ = static_cast <uint32_t> (p - line);
+  *cp++  = static_cast <uint32_t> (unicode (q, b));
+  p += std::min (static_cast <ptrdiff_t> (b), end - p); // truncated at the end
+}
+
+static size_t u8_decode_scalar (const char* p, const char* end, const char* line, uint32_t* cp, uint32_t* off) {
+  const uint32_t* const cp0 = cp;
+  while (p < end) u8_decode_char (p, end, line, cp, off);
+  return static_cast <size_t> (cp - cp0);
+}
+
+#ifdef JAGGER_X86_SIMD
+// 16 bytes from p; leading ASCII or four 3-byte characters (false if neither)
+__attribute__ ((target ("sse4.1")))
+static inline bool u8_decode_block16 (const char*& p, const char* line, uint32_t*& cp, uint32_t*& off) {
+  const __m128i v = _mm_loadu_si128 (reinterpret_cast <const __m128i*> (p));
+  const __m128i base = _mm_set1_epi32 (static_cast <int> (p - line));
+  const unsigned int mask = static_cast <unsigned int> (_mm_movemask_epi8 (v));
+  if (! (mask & 1)) {
+    const int n = mask ? __builtin_ctz (mask) : 16;
+    _mm_storeu_si128 (reinterpret_cast <__m128i*> (cp),      _mm_cvtepu8_epi32 (v));
+    _mm_storeu_si128 (reinterpret_cast <__m128i*> (cp + 4),  _mm_cvtepu8_epi32 (_mm_srli_si128 (v, 4)));
+    _mm_storeu_si128 (reinterpret_cast <__m128i*> (cp + 8),  _mm_cvtepu8_epi32 (_mm_srli_si128 (v, 8)));
+    _mm_storeu_si128 (reinterpret_cast <__m128i*> (cp + 12), _mm_cvtepu8_epi32 (_mm_srli_si128 (v, 12)));
+    for (int i = 0; i < n; i += 4)
+      _mm_storeu_si128 (reinterpret_cast <__m128i*> (off + i), _mm_add_epi32 (base, _mm_setr_epi32 (i, i + 1, i + 2, i + 3)));
+    p += n, cp += n, off += n;
+    return true;
+  }
+  // 1110xxxx 10xxxxxx 10xxxxxx x 4 (+ 4 bytes ignored)
+  const __m128i m = _mm_setr_epi8 (-16, -64, -64, -16, -64, -64, -16, -64, -64, -16, -64, -64, 0, 0, 0, 0);
+  const __m128i e = _mm_setr_epi8 (-32, -128, -128, -32, -128, -128, -32, -128, -128, -32, -128, -128, 0, 0, 0, 0);
+  if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_and_si128 (v, m), e)) != 0xffff) return false;
+  const __m128i x = _mm_shuffle_epi8 (v, _mm_setr_epi8 (2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1));
+  _mm_storeu_si128 (reinterpret_cast <__m128i*> (cp),
+                    _mm_or_si128 (_mm_or_si128 (_mm_and_si128 (_mm_srli_epi32 (x, 4), _mm_set1_epi32 (0xf000)),
+                                                _mm_and_si128 (_mm_srli_epi32 (x, 2), _mm_set1_epi32 (0x0fc0))),
+                                  _mm_and_si128 (x, _mm_set1_epi32 (0x3f))));
+  _mm_storeu_si128 (reinterpret_cast <__m128i*> (off), _mm_add_epi32 (base, _mm_setr_epi32 (0, 3, 6, 9)));
+  p += 12, cp += 4, off += 4;
+  return true;
+}
+
+// 32 bytes from p; leading ASCII or eight 3-byte characters (false if neither)
+__attribute__ ((target ("avx2")))
+static inline bool u8_decode_block32 (const char*& p, const char* line, uint32_t*& cp, uint32_t*& off) {
+  const __m256i v = _mm256_loadu_si256 (reinterpret_cast <const __m256i*> (p));
+  const __m256i base = _mm256_set1_epi32 (static_cast <int> (p - line));
+  const unsigned int mask = static_cast <unsigned int> (_mm256_movemask_epi8 (v));
+  if (! (mask & 1)) {
+    const int n = mask ? __builtin_ctz (mask) : 32;
+    for (int i = 0; i < n; i += 8) {
+      _mm256_storeu_si256 (reinterpret_cast <__m256i*> (cp + i), _mm256_cvtepu8_epi32 (_mm_loadl_epi64 (reinterpret_cast <const __m128i*> (p + i))));
+      _mm256_storeu_si256 (reinterpret_cast <__m256i*> (off + i), _mm256_add_epi32 (base, _mm256_setr_epi32 (i, i + 1, i + 2, i + 3, i + 4, i + 5, i + 6, i + 7)));
+    }
+    p += n, cp += n, off += n;
+    return true;
+  }
+  // two lanes of 12 bytes; p[0, 12) and p[12, 24)
+  const __m256i w = _mm256_inserti128_si256 (_mm256_castsi128_si256 (_mm_loadu_si128 (reinterpret_cast <const __m128i*> (p))),
+                                             _mm_loadu_si128 (reinterpret_cast <const __m128i*> (p + 12)), 1);
+  const __m256i m = _mm256_setr_epi8 (-16, -64, -64, -16, -64, -64, -16, -64, -64, -16, -64, -64, 0, 0, 0, 0,
+                                      -16, -64, -64, -16, -64, -64, -16, -64, -64, -16, -64, -64, 0, 0, 0, 0);
+  const __m256i e = _mm256_setr_epi8 (-32, -128, -128, -32, -128, -128, -32, -128, -128, -32, -128, -128, 0, 0, 0, 0,
+                                      -32, -128, -128, -32, -128, -128, -32, -128, -128, -32, -128, -128, 0, 0, 0, 0);
+  if (_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_and_si256 (w, m), e)) != -1) return false;
+  const __m256i x = _mm256_shuffle_epi8 (w, _mm256_setr_epi8 (2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+                                                              2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1));
+  _mm256_storeu_si256 (reinterpret_cast <__m256i*> (cp),
+                       _mm256_or_si256 (_mm256_or_si256 (_mm256_and_si256 (_mm256_srli_epi32 (x, 4), _mm256_set1_epi32 (0xf000)),
+                                                         _mm256_and_si256 (_mm256_srli_epi32 (x, 2), _mm256_set1_epi32 (0x0fc0))),
+                                        _mm256_and_si256 (x, _mm256_set1_epi32 (0x3f))));
+  _mm256_storeu_si256 (reinterpret_cast <__m256i*> (off), _mm256_add_epi32 (base, _mm256_setr_epi32 (0, 3, 6, 9, 12, 15, 18, 21)));
+  p += 24, cp += 8, off += 8;
+  return true;
+}
+
+__attribute__ ((target ("sse4.1")))
+static size_t u8_decode_sse41 (const char* p, const char* end, const char* line, uint32_t* cp, uint32_t* off) {
+  const uint32_t* const cp0 = cp;
+  while (end - p >= 16)
+    if (! u8_decode_block16 (p, line, cp, off)) u8_decode_char (p, end, line, cp, off);
+  while (p < end) u8_decode_char (p, end, line, cp, off);
+  return static_cast <size_t> (cp - cp0);
+}
+
+__attribute__ ((target ("avx2")))
+static size_t u8_decode_avx2 (const char* p, const char* end, const char* line, uint32_t* cp, uint32_t* off) {
+  const uint32_t* const cp0 = cp;
+  while (end - p >= 32)
+    if (! u8_decode_block32 (p, line, cp, off) && ! u8_decode_block16 (p, line, cp, off))
+      u8_decode_char (p, end, line, cp, off);
+  while (end - p >= 16)
+    if (! u8_decode_block16 (p, line, cp, off)) u8_decode_char (p, end, line, cp, off);
+  while (p < end) u8_decode_char (p, end, line, cp, off);
+  return static_cast <size_t> (cp - cp0);
+}
+#endif
+
+// the best kernel for the running CPU
+static inline u8_decoder_t u8_decoder () {
+#ifdef JAGGER_X86_SIMD
+  static const u8_decoder_t decode = __builtin_cpu_supports ("avx2")   ? u8_decode_avx2 :
+                                     __builtin_cpu_supports ("sse4.1") ? u8_decode_sse41 : u8_decode_scalar;
+  return decode;
+#else
+  return u8_decode_scalar;
+#endif
+}
+
+// first line break ('\n', '\r' or '\0') in [p, end); end if none
+typedef const char* (*line_break_finder_t) (const char* p, const char* end);
+
+static inline const char* find_line_break_scalar (const char* p, const char* end) {
+  while (p < end && *p != '\n' && *p != '\r' && *p) ++p;
+  return p;
+}
+
+#ifdef JAGGER_X86_SIMD
+__attribute__ ((target ("sse2")))
+static const char* find_line_break_sse2 (const char* p, const char* end) {
+  const __m128i nl = _mm_set1_epi8 ('\n'), cr = _mm_set1_epi8 ('\r'), nul = _mm_setzero_si128 ();
+  for (; end - p >= 16; p += 16) {
+    const __m128i v = _mm_loadu_si128 (reinterpret_cast <const __m128i*> (p));
+    const int mask = _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, nl), _mm_cmpeq_epi8 (v, cr)), _mm_cmpeq_epi8 (v, nul)));
+    if (mask) return p + __builtin_ctz (static_cast <unsigned int> (mask));
+  }
+  return find_line_break_scalar (p, end);
+}
+
+__attribute__ ((target ("avx2")))
+static const char* find_line_break_avx2 (const char* p, const char* end) {
+  const __m256i nl = _mm256_set1_epi8 ('\n'), cr = _mm256_set1_epi8 ('\r'), nul = _mm256_setzero_si256 ();
+  for (; end - p >= 32; p += 32) {
+    const __m256i v = _mm256_loadu_si256 (reinterpret_cast <const __m256i*> (p));
+    const int mask = _mm256_movemask_epi8 (_mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, nl), _mm256_cmpeq_epi8 (v, cr)), _mm256_cmpeq_epi8 (v, nul)));
+    if (mask) return p + __builtin_ctz (static_cast <unsigned int> (mask));
+  }
+  return find_line_break_scalar (p, end);
+}
+#endif
+
+static inline line_break_finder_t line_break_finder () {
+#ifdef JAGGER_X86_SIMD
+  static const line_break_finder_t find = __builtin_cpu_supports ("avx2") ? find_line_break_avx2 :
+                                          __builtin_cpu_supports ("sse2") ? find_line_break_sse2 : find_line_break_scalar;
+  return find;
+#else
+  return find_line_break_scalar;
+#endif
+}
+
+// character IDs of a line decoded once before tagging; the trie walks from
+// each position read them instead of decoding the same bytes again
+//   id[k]: ID of the k-th character (0 after the last), off[k]: its byte offset
+class char_ids {
+private:
+  std::vector <uint32_t> _cp;
+public:
+  std::vector <uint16_t> id;
+  std::vector <uint32_t> off;
+  char_ids () : _cp (), id (), off () {}
+  // returns # characters in [p, end)
+  size_t decode (const char* p, const char* end, const c2i_map& c2i) {
+    const size_t len = static_cast <size_t> (end - p);
+    if (_cp.size () < len + 32) {
+      _cp.resize (len + 32);
+      off.resize (len + 32);
+      id.resize (len + 1);
+    }
+    const size_t n = u8_decoder () (p, end, p, &_cp[0], &off[0]);
+    for (size_t k = 0; k < n; ++k)
+      id[k] = c2i[_cp[k]];
+    id[n] = 0;
+    off[n] = static_cast <uint32_t> (len);
+    return n;
+  }
+  // index of the character starting bytes after the k-th one (of n)
+  size_t skip (size_t k, const size_t bytes, const size_t n) const {
+    const size_t to = off[k] + bytes;
+    while (k < n && off[++k] < to) ;
+    return k;
+  }
+};
+
+namespace ccedar {
+  // hot core of the pattern trie; a small double array holding the most
+  // visited nodes, each of which is mapped to its node in the full trie
+  //   [hot_header][node x size][int32_t (node in the full trie) x size]
+  struct hot_header {
+    char     magic[8];  // "JAGGERH"
+    uint64_t size;      // # nodes of the hot core
+    uint64_t da_digest; // da_digest () of the full trie
+  };
+  class hot_da : public frozen_da <int, int> {
+  private:
+    const int* _full;
+  public:
+    hot_da () : frozen_da <int, int> (), _full (0) {}
+    // refer to an image (e.g., mmap-ed file) built for the full trie da;
+    // false if malformed or built for another trie
+    bool set_image (const void* p, const size_t nbytes, const void* da, const size_t da_nbytes) {
+      const hot_header* h = static_cast <const hot_header*> (p);
+      if (nbytes < sizeof (hot_header) || std::memcmp (h->magic, "JAGGERH", 8) != 0 ||
+          nbytes != sizeof (hot_header) + h->size * (sizeof (node) + sizeof (int)) ||
+          h->da_digest != da_digest (da, da_nbytes))
+        return false;
+      set_array (h + 1, h->size * sizeof (node));
+      _full = reinterpret_cast <const int*> (_array + _size);
+      return true;
+    }
+    bool follow (size_t& from, const ukey_type label) const { return _follow (from, label); }
+    int value (const size_t from) const { return _value (from); }
+    size_t full (const size_t from) const { return static_cast <size_t> (_full[from]); }
+  };
+  static inline uint32_t popcount64 (uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast <uint32_t> (__builtin_popcountll (x));
+#else
+    x -= (x >> 1) & 0x5555555555555555ULL;
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return static_cast <uint32_t> ((x * 0x0101010101010101ULL) >> 56);
+#endif
+  }
+  // POS-context table of the pattern trie; for each node where a search may
+  // end, patterns conditioned on the previous POS that the walk from the node
+  // up to the deepest node with a value finds (the nearest one wins). only
+  // the nodes with such patterns are indexed: a bit per trie node marks them
+  // and the rank of the bit locates the offset of the node's list
+  //   [pos_header][uint64_t (bits) x words][uint32_t (rank) x words (+ pad)]
+  //   [uint32_t (offset to list) x nodes (+ pad)][uint64_t x size]
+  // where words = (# da nodes + 63) / 64; a list is
+  // [# entries][(label << 32) | value]... sorted by label
+  struct pos_header {
+    char     magic[8];  // "JAGGERC"
+    uint64_t size;      // # uint64_t of the lists
+    uint64_t nodes;     // # nodes with a list
+    uint64_t da_digest; // da_digest () of the trie
+  };
+  class pos_table {
+  private:
+    const uint64_t* _bits;
+    const uint32_t* _rank;
+    const uint32_t* _head;
+    const uint64_t* _entries;
+    static size_t _pad (const size_t n) { return (n + 1) & ~static_cast <size_t> (1); }
+  public:
+    pos_table () : _bits (0), _rank (0), _head (0), _entries (0) {}
+    static size_t words (const size_t da_nodes) { return (da_nodes + 63) / 64; }
+    // bytes of the image
+    static size_t nbytes (const size_t da_nodes, const size_t nodes, const size_t size) {
+      return sizeof (pos_header) + words (da_nodes) * sizeof (uint64_t) + _pad (words (da_nodes)) * sizeof (uint32_t) +
+             _pad (nodes) * sizeof (uint32_t) + size * sizeof (uint64_t);
+    }
+    // false if malformed or built for another trie
+    bool set_image (const void* p, const size_t nbytes_, const void* da, const size_t da_nbytes) {
+      const pos_header* h = static_cast <const pos_header*> (p);
+      const size_t da_nodes = da_nbytes / sizeof (frozen_da <int, int>::node);
+      if (nbytes_ < sizeof (pos_header) || std::memcmp (h->magic, "JAGGERC", 8) != 0 ||
+          nbytes_ != nbytes (da_nodes, h->nodes, h->size) ||
+          h->da_digest != da_digest (da, da_nbytes))
+        return false;
+      _bits = reinterpret_cast <const uint64_t*> (h + 1);
+      _rank = reinterpret_cast <const uint32_t*> (_bits + words (da_nodes));
+      _head = _rank + _pad (words (da_nodes));
+      _entries = reinterpret_cast <const uint64_t*> (_head + _pad (h->nodes));
+      return true;
+    }
+    bool empty () const { return ! _bits; }
+    // value of the pattern for label (previous POS) at node from; n if none
+    int find (const size_t from, const int label, const int n) const {
+      const uint64_t bits = _bits[from >> 6], bit = static_cast <uint64_t> (1) << (from & 63);
+      if (! (bits & bit)) return n;
+      const uint64_t* e = _entries + _head[_rank[from >> 6] + popcount64 (bits & (bit - 1))];
+      for (uint64_t k = *e; k; --k) {
+        const uint64_t label_ = *++e >> 32;
+        if (label_ >= static_cast <uint64_t> (label))
+          return label_ == static_cast <uint64_t> (label) ? static_cast <int> (static_cast <uint32_t> (*e)) : n;
+      }
+      return n;
+    }
+  };
+  // pattern trie used by the tagger; read-only view of a compiled .da image
+  class da_ : public ccedar::frozen_da <int, int> {
+  private:
+    hot_da    _hot;    // consulted first if any
+    pos_table _pos;    // replaces the walk for POS-context patterns if any
+    uint32_t* _visits; // visit counts of nodes (profiling)
+  public:
+    da_ () : frozen_da <int, int> (), _hot (), _pos (), _visits (0) {}
+    bool set_hot (const void* p, const size_t nbytes)
+    { return _hot.set_image (p, nbytes, _array, _size * sizeof (node)); }
+    bool set_pos (const void* p, const size_t nbytes)
+    { return _pos.set_image (p, nbytes, _array, _size * sizeof (node)); }
+    const hot_da& hot () const { return _hot; }
+    // count visits of each node (size () counters) instead of using the hot core
+    void profile (uint32_t* visits) { _visits = visits; }
+    struct utf8_feeder { // feed one UTF-8 character by one while mapping codes
+      const char *p, * const end;
+      const c2i_map& c2i;
+      int b;
+      utf8_feeder (const char *key_, const char *end_, const c2i_map& c2i_) : p (key_), end (end_), c2i (c2i_), b (0) {}
+      int read () { return p == end ? 0 : c2i[unicode (p, b)]; }
+      void advance () { p += b; }
+    };
+    struct id_feeder { // feed character IDs decoded in advance (char_ids)
+      const uint16_t* p;
+      explicit id_feeder (const uint16_t* ids) : p (ids) {}
+      int read () const { return *p; }
+      void advance () { ++p; }
+    };
+    int longestPrefixSearchWithPOS (const char* key, const char* const end, int fi_prev, const c2i_map& c2i, size_t from = 0) const {
+      utf8_feeder f (key, end, c2i);
+      return _visits ? _search <true>  (f, fi_prev, from) : _search <false> (f, fi_prev, from);
+    }
+    // ids: character IDs from the position, terminated by 0 (char_ids::id)
+    int longestPrefixSearchWithPOS (const uint16_t* ids, int fi_prev, size_t from = 0) const {
+      id_feeder f (ids);
+      return _visits ? _search <true>  (f, fi_prev, from) : _search <false> (f, fi_prev, from);
+    }
+  private:
+    template <const bool PROFILE, typename T>
+    int _search (T& f, int fi_prev, size_t from) const {
+      size_t from_ = 0;
+      int n (0);
+      int i = f.read ();
+      if (! PROFILE && ! from && _hot.size ()) { // leave the hot core when the path does
+        size_t h = 0;
+        for (; i && _hot.follow (h, static_cast <ukey_type> (i)); f.advance (), i = f.read ()) {
+          const int n_ = _hot.value (h);
+          if (n_ == CEDAR_NO_VALUE) continue;
+          from_ = _hot.full (h);
+          n = n_;
+        }
+        from = _hot.full (h);
+      }
+      if (PROFILE) ++_visits[from];
+      for (; i; f.advance (), i = f.read ()) {
+        if (! _follow (from, static_cast <ukey_type> (i))) break;
+        if (PROFILE) ++_visits[from];
+        const int n_ = _value (from);
+        if (n_ == CEDAR_NO_VALUE) continue;
+        from_ = from;
+        n = n_;
+      }
+      // ad-hock matching at the moment; it prefers POS-ending patterns
+      if (! fi_prev) return n;
+      if (from != from_ && ! _pos.empty ()) return _pos.find (from, fi_prev, n); // > 1 node to walk
+      for (;; from = _array[from].check) { // hopefully, in the cache
+        const int n_ = exactMatchSearch <int> (&fi_prev, 1, from);
+        if (n_ != CEDAR_NO_VALUE) return n_;
+        if (from == from_)        return n;
+      }
+    }
+  };
+}
+
+// groups words found in a line into tokens (a run of words of the same
+// character type is a token) and passes each token to sink:
+//   sink (begin, end, r, concat): bytes [begin, end) of the line, search
+//   result r of the last word, and whether it has multiple words
+template <typename Sink>
+class token_grouper {
+private:
+  Sink&  _sink;
+  size_t _begin, _end;
+  int    _r, _bytes;
+  bool   _concat, _empty;
+public:
+  explicit token_grouper (Sink& sink) : _sink (sink), _begin (0), _end (0), _r (0), _bytes (0), _concat (false), _empty (true) {}
+  // word of bytes from begin; r: result of longestPrefixSearchWithPOS
+  void add (const size_t begin, const int bytes, const int r) {
+    if (_empty) {
+      _empty = false;
+      _begin = begin;
+    } else {
+      const int ctype_prev = (_r >> 20) & 0x7; // 0: num|unk / 1: alpha
+      const int ctype      = (r  >> 20) & 0x7; // 2: kana / 3: other
+      if (ctype_prev != ctype || // different character types
+          ctype_prev == 3 ||     // seen words in non-num/alpha/kana
+          (ctype_prev == 2 && _bytes + bytes >= 18)) {
+        _sink (_begin, _end, _r, _concat);
+        _begin  = begin;
+        _concat = false;
+      } else
+        _concat = true;
+    }
+    _end   = begin + static_cast <size_t> (bytes);
+    _r     = r;
+    _bytes = bytes;
+  }
+  // passes the last token
+  void flush () {
+    if (! _empty) _sink (_begin, _end, _r, _concat);
+    _empty  = true;
+    _concat = false;
+  }
+};
+
+// the tagging loop shared by the CLI and the Python binding; finds the words
+// of a line decoded into chars (of n characters) and passes the tokens to sink
+// (see token_grouper)
+template <typename Sink>
+static inline void tag_line (const ccedar::da_& da, const uint64_t* p2f, const c2i_map& c2i, const char_ids& chars, const size_t n, Sink& sink) {
+  token_grouper <Sink> tokens (sink);
+  uint64_t offsets = c2i[CP_MAX + 1];
+  for (size_t k = 0; k != n; ) {
+    const int r = da.longestPrefixSearchWithPOS (&chars.id[k], offsets & 0x3fff); // found word
+    const int bytes = (r >> 23) ? (r >> 23) : static_cast <int> (chars.off[k + 1] - chars.off[k]);
+    tokens.add (chars.off[k], bytes, r);
+    offsets = p2f[r & 0xfffff];
+    k = chars.skip (k, static_cast <size_t> (bytes), n);
+  }
+  tokens.flush ();
+}
+
 class sbag_t {
 private:
   ccedar::da <char, int>    _str2id;
@@ -151,6 +670,107 @@ public:
   }
 };
 
+static inline bool is_gzip (const void* p, const size_t size) {
+  const unsigned char* q = static_cast <const unsigned char*> (p);
+  return size >= 2 && q[0] == 0x1f && q[1] == 0x8b;
+}
+
+// reads fd as ::read (); gzip-compressed input (incl. concatenated members)
+// is decompressed when built with zlib (JAGGER_WITH_ZLIB)
+class input_stream {
+private:
+  const int _fd;
+  int _gz; // -1: not checked yet
+  std::vector <unsigned char> _buf; // input read ahead
+  size_t _pos, _size;
+  bool _member_end;
+  const char* _err;
+#if defined(JAGGER_WITH_ZLIB)
+  z_stream _z;
+#endif
+  input_stream (const input_stream&);
+  input_stream& operator= (const input_stream&);
+  long fill () { // read input into _buf
+    const long r = static_cast <long> (::read (_fd, &_buf[0], _buf.size ()));
+    if (r < 0) _err = "failed to read input";
+    _pos = 0;
+    _size = r > 0 ? static_cast <size_t> (r) : 0;
+    return r;
+  }
+public:
+  explicit input_stream (const int fd) : _fd (fd), _gz (-1), _buf (BUF_SIZE), _pos (0), _size (0), _member_end (false), _err (0) {
+#if defined(JAGGER_WITH_ZLIB)
+    std::memset (&_z, 0, sizeof (_z));
+#endif
+  }
+  ~input_stream () {
+#if defined(JAGGER_WITH_ZLIB)
+    if (_gz == 1) inflateEnd (&_z);
+#endif
+  }
+  // bytes read to buf; 0 at EOF and -1 on error (see error ())
+  long read (char* buf, const size_t size) {
+    if (_gz < 0) { // check the magic
+      while (_size < 2 && (_size == 0 || _buf[0] == 0x1f)) {
+        const long r = static_cast <long> (::read (_fd, &_buf[_size], _buf.size () - _size));
+        if (r <= 0) { if (r < 0) _err = "failed to read input"; break; }
+        _size += static_cast <size_t> (r);
+      }
+      _gz = is_gzip (&_buf[0], _size);
+#if defined(JAGGER_WITH_ZLIB)
+      if (_gz && inflateInit2 (&_z, 16 + MAX_WBITS) != Z_OK) _err = "failed to initialize zlib";
+#else
+      if (_gz) _err = "gzip input is not supported (built without zlib)";
+#endif
+    }
+    if (_err) return -1;
+    if (! _gz) {
+      if (_pos == _size) {
+        const long r = static_cast <long> (::read (_fd, buf, size));
+        if (r < 0) _err = "failed to read input";
+        return r;
+      }
+      const size_t n = std::min (size, _size - _pos);
+      std::memcpy (buf, &_buf[_pos], n);
+      _pos += n;
+      return static_cast <long> (n);
+    }
+#if defined(JAGGER_WITH_ZLIB)
+    _z.next_out = reinterpret_cast <Bytef*> (buf);
+    _z.avail_out = static_cast <uInt> (std::min (size, static_cast <size_t> (1) << 30));
+    const uInt avail = _z.avail_out;
+    while (_z.avail_out == avail) { // until some output
+      if (_pos == _size) {
+        const long r = fill ();
+        if (r < 0) return -1;
+        if (r == 0) {
+          if (! _member_end) { _err = "unexpected end of gzip input"; return -1; }
+          return 0;
+        }
+      }
+      if (_member_end) { // next member
+        inflateReset (&_z);
+        _member_end = false;
+      }
+      _z.next_in = &_buf[_pos];
+      _z.avail_in = static_cast <uInt> (_size - _pos);
+      const int ret = inflate (&_z, Z_NO_FLUSH);
+      _pos = _size - _z.avail_in;
+      if (ret == Z_STREAM_END)
+        _member_end = true;
+      else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        _err = "corrupted gzip input";
+        return -1;
+      }
+    }
+    return static_cast <long> (avail - _z.avail_out);
+#else
+    return -1;
+#endif
+  }
+  const char* error () const { return _err; }
+};
+
 class simple_reader {
 private:
   const int _fd;
@@ -184,4 +804,543 @@ public:
     } while (1);
   }
 };
+
+// packed model (.jgm): a single file holding all arrays of a compiled model
+//   [jgm_header][jgm_section x num_sections][pad][section][pad][section]...
+// section offsets are aligned to JGM_ALIGN so that each section can be
+// mmap-ed / madvise-d independently.
+static const char     JGM_MAGIC[8] = {'J', 'A', 'G', 'G', 'E', 'R', 'M', '\0'};
+static const uint32_t JGM_VERSION  = 1;
+static const size_t   JGM_ALIGN    = 1 << 16; // >= page size of common platforms
+enum { JGM_DA = 1, JGM_C2I = 2, JGM_P2F = 3, JGM_FS = 4, JGM_C2I_PAGED = 5, JGM_HOT = 6, JGM_POS = 7 }; // section IDs
+
+struct jgm_section {
+  uint32_t id;
+  uint32_t reserved;
+  uint64_t offset; // from the beginning of the file
+  uint64_t size;   // in bytes
+};
+
+struct jgm_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t num_sections;
+  uint64_t file_size;
+  uint64_t fingerprint; // FNV-1a of all section contents; identifies a build
+};
+
+// replace fn w/ tmp; readers see either the old or the new file
+static inline bool rename_file (const std::string& tmp, const std::string& fn) {
+#ifdef _WIN32
+  return MoveFileExA (tmp.c_str (), fn.c_str (), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  return std::rename (tmp.c_str (), fn.c_str ()) == 0;
+#endif
+}
+
+// per-process temporary name so that concurrent writers do not collide
+static inline std::string tmp_name (const std::string& fn) {
+#ifdef _WIN32
+  const unsigned long pid = static_cast <unsigned long> (GetCurrentProcessId ());
+#else
+  const unsigned long pid = static_cast <unsigned long> (::getpid ());
+#endif
+  char buf[32];
+  std::snprintf (buf, sizeof (buf), ".tmp.%lu", pid);
+  return fn + buf;
+}
+
+// write data to fn.tmp.PID and rename it to fn
+static inline void write_file_atomic (const void* data, const size_t size, const std::string& fn) {
+  const std::string tmp (tmp_name (fn));
+  FILE *fp = std::fopen (tmp.c_str (), "wb");
+  if (! fp) my_errx (1, "cannot write: %s", tmp.c_str ());
+  if (size) std::fwrite (data, 1, size, fp);
+  if (std::fclose (fp) != 0 || ! rename_file (tmp, fn))
+    my_errx (1, "cannot write: %s", fn.c_str ());
+}
+
+// read the whole of fn into buf
+static inline void read_file (const std::string& fn, std::vector <char>& buf) {
+  FILE* fp = std::fopen (fn.c_str (), "rb");
+  if (! fp) my_errx (1, "no such file: %s", fn.c_str ());
+  std::fseek (fp, 0, SEEK_END);
+  buf.resize (static_cast <size_t> (std::ftell (fp)));
+  std::fseek (fp, 0, SEEK_SET);
+  if (buf.empty () || std::fread (&buf[0], 1, buf.size (), fp) != buf.size ())
+    my_errx (1, "failed to read: %s", fn.c_str ());
+  std::fclose (fp);
+}
+
+// create the missing directories in the path of fn (e.g., out/ of out/patterns)
+static inline void make_dirs (const std::string& fn) {
+  for (size_t i = fn.find_first_of ("/\\", 1); i != std::string::npos; i = fn.find_first_of ("/\\", i + 1)) {
+    const std::string dir (fn, 0, i);
+#ifdef _WIN32
+    const DWORD attr = GetFileAttributesA (dir.c_str ());
+    if (attr != INVALID_FILE_ATTRIBUTES ? (attr & FILE_ATTRIBUTE_DIRECTORY) != 0
+        : CreateDirectoryA (dir.c_str (), NULL) || GetLastError () == ERROR_ALREADY_EXISTS) continue;
+#else
+    struct stat st;
+    if (::stat (dir.c_str (), &st) == 0 ? S_ISDIR (st.st_mode)
+        : ::mkdir (dir.c_str (), 0777) == 0 || errno == EEXIST) continue;
+#endif
+    my_errx (1, "cannot create directory: %s", dir.c_str ());
+  }
+}
+
+// read-only view of a .jgm image (e.g., mmap-ed file)
+class packed_model {
+private:
+  const char*        _data;
+  size_t             _size;
+  const jgm_header*  _header;
+  const jgm_section* _sections;
+public:
+  packed_model () : _data (0), _size (0), _header (0), _sections (0) {}
+  // returns an error message or 0 on success
+  const char* open (const void* data, const size_t size) {
+    _data = static_cast <const char*> (data); _size = size;
+    if (size < sizeof (jgm_header)) return "too small for a packed model";
+    _header = reinterpret_cast <const jgm_header*> (_data);
+    if (std::memcmp (_header->magic, JGM_MAGIC, sizeof (JGM_MAGIC)) != 0)
+      return "not a packed model (bad magic)";
+    if (_header->version != JGM_VERSION) return "unsupported packed model version";
+    if (_header->file_size != size) return "truncated or corrupted packed model";
+    if (sizeof (jgm_header) + _header->num_sections * sizeof (jgm_section) > size)
+      return "corrupted section table";
+    _sections = reinterpret_cast <const jgm_section*> (_data + sizeof (jgm_header));
+    for (uint32_t i = 0; i < _header->num_sections; ++i)
+      if (_sections[i].offset > size || _sections[i].size > size - _sections[i].offset)
+        return "section out of range";
+    return 0;
+  }
+  // returns 0 if the section is missing
+  const void* section (const uint32_t id, size_t& size) const {
+    for (uint32_t i = 0; i < _header->num_sections; ++i)
+      if (_sections[i].id == id) {
+        size = static_cast <size_t> (_sections[i].size);
+        return _data + _sections[i].offset;
+      }
+    size = 0;
+    return 0;
+  }
+  uint64_t fingerprint () const { return _header->fingerprint; }
+  // recompute the fingerprint (touches the whole file)
+  bool verify () const {
+    uint64_t h = fnv1a64 (0, 0);
+    for (uint32_t i = 0; i < _header->num_sections; ++i)
+      h = fnv1a64 (_data + _sections[i].offset, _sections[i].size, h);
+    return h == _header->fingerprint;
+  }
+};
+
+// writes a .jgm file; added buffers must be alive until save ()
+class packed_model_writer {
+private:
+  std::vector <std::pair <uint32_t, std::pair <const void*, size_t> > > _sections;
+public:
+  void add (const uint32_t id, const void* p, const size_t size)
+  { _sections.push_back (std::make_pair (id, std::make_pair (p, size))); }
+  // written to fn.tmp.PID and then renamed to fn for atomic deploy
+  uint64_t save (const std::string& fn) const {
+    jgm_header h;
+    std::memcpy (h.magic, JGM_MAGIC, sizeof (JGM_MAGIC));
+    h.version = JGM_VERSION;
+    h.num_sections = static_cast <uint32_t> (_sections.size ());
+    h.fingerprint = fnv1a64 (0, 0);
+    std::vector <jgm_section> table (_sections.size ());
+    uint64_t offset = sizeof (jgm_header) + table.size () * sizeof (jgm_section);
+    for (size_t i = 0; i < _sections.size (); ++i) {
+      offset = (offset + JGM_ALIGN - 1) / JGM_ALIGN * JGM_ALIGN;
+      table[i].id = _sections[i].first;
+      table[i].reserved = 0;
+      table[i].offset = offset;
+      table[i].size = _sections[i].second.second;
+      offset += table[i].size;
+      h.fingerprint = fnv1a64 (_sections[i].second.first, _sections[i].second.second, h.fingerprint);
+    }
+    h.file_size = offset;
+    const std::string tmp (tmp_name (fn));
+    FILE* fp = std::fopen (tmp.c_str (), "wb");
+    if (! fp) my_errx (1, "cannot write: %s", tmp.c_str ());
+    std::fwrite (&h, sizeof (jgm_header), 1, fp);
+    if (! table.empty ())
+      std::fwrite (&table[0], sizeof (jgm_section), table.size (), fp);
+    uint64_t pos = sizeof (jgm_header) + table.size () * sizeof (jgm_section);
+    for (size_t i = 0; i < _sections.size (); ++i) {
+      for (; pos < table[i].offset; ++pos) std::fputc (0, fp);
+      std::fwrite (_sections[i].second.first, 1, _sections[i].second.second, fp);
+      pos += table[i].size;
+    }
+    if (std::fclose (fp) != 0 || ! rename_file (tmp, fn))
+      my_errx (1, "cannot write: %s", fn.c_str ());
+    return h.fingerprint;
+  }
+};
+
+// hint the kernel about the access pattern of a section of a mapped file
+static inline void advise_section (const void* p, const size_t size, const bool random) {
+#if defined(JAGGER_USE_MMAP_IO) && !defined(_WIN32) && defined(MADV_WILLNEED)
+  const uintptr_t page = static_cast <uintptr_t> (::sysconf (_SC_PAGESIZE));
+  const uintptr_t beg = reinterpret_cast <uintptr_t> (p) / page * page;
+  const uintptr_t end = reinterpret_cast <uintptr_t> (p) + size;
+  ::madvise (reinterpret_cast <void*> (beg), end - beg, MADV_WILLNEED);
+  if (random) ::madvise (reinterpret_cast <void*> (beg), end - beg, MADV_RANDOM);
+#else
+  (void) p; (void) size; (void) random;
+#endif
+}
+
+// build the hot core (ccedar::hot_da) of a trie image from node weights
+// (e.g., visit counts); the budget heaviest nodes and their ancestors
+static inline void build_hot (const void* da, const size_t nbytes, const std::vector <uint64_t>& weights, const size_t budget, std::vector <char>& image) {
+  typedef ccedar::da_builder <int, int, MAX_KEY_BITS> builder_t;
+  const builder_t::node* array = static_cast <const builder_t::node*> (da);
+  const size_t size = nbytes / sizeof (builder_t::node);
+  std::vector <size_t> head, child;
+  builder_t::children (array, size, head, child);
+  std::vector <std::pair <uint64_t, size_t> > nodes; // non-terminal nodes
+  for (size_t e = 1; e < size; ++e)
+    if (array[e].check >= 0 && array[array[e].check].base != static_cast <int> (e) && weights[e])
+      nodes.push_back (std::make_pair (weights[e], e));
+  const size_t n = std::min (budget, nodes.size ());
+  std::partial_sort (nodes.begin (), nodes.begin () + static_cast <long> (n), nodes.end (),
+                     std::greater <std::pair <uint64_t, size_t> > ());
+  std::vector <char> hot (size, 0);
+  hot[0] = 1;
+  for (size_t i = 0; i < n; ++i) // with ancestors
+    for (size_t e = nodes[i].second; ! hot[e]; e = static_cast <size_t> (array[e].check))
+      hot[e] = 1;
+  // keys of hot nodes that have a value or no hot child
+  builder_t::keys_t keys;
+  builder_t::key_t key;
+  std::vector <std::pair <size_t, size_t> > stack (1, std::make_pair (0, 0)); // (node, depth)
+  while (! stack.empty ()) {
+    const size_t from = stack.back ().first;
+    key.resize (stack.back ().second);
+    stack.pop_back ();
+    if (from) key.push_back (static_cast <unsigned int> (array[array[from].check].base ^ static_cast <int> (from)));
+    int value = -1; // CEDAR_NO_VALUE
+    bool leaf = true;
+    for (size_t i = head[from]; i < head[from + 1]; ++i)
+      if (child[i] == static_cast <size_t> (array[from].base)) // terminal
+        value = array[child[i]].base;
+      else if (hot[child[i]])
+        leaf = false, stack.push_back (std::make_pair (child[i], key.size ()));
+    if (from && (value != -1 || leaf))
+      keys.push_back (std::make_pair (key, value));
+  }
+  builder_t da_hot;
+  da_hot.build (keys, builder_t::BFS);
+  // map each hot node to the full trie
+  const builder_t::node* array_hot = static_cast <const builder_t::node*> (da_hot.array ());
+  std::vector <int> full (da_hot.size (), -1);
+  std::vector <std::pair <size_t, size_t> > pairs (1, std::make_pair (0, 0)); // (full, hot)
+  while (! pairs.empty ()) {
+    const size_t from = pairs.back ().first, from_hot = pairs.back ().second;
+    pairs.pop_back ();
+    full[from_hot] = static_cast <int> (from);
+    for (size_t i = head[from]; i < head[from + 1]; ++i)
+      if (hot[child[i]] && child[i] != static_cast <size_t> (array[from].base)) {
+        const int label = array[from].base ^ static_cast <int> (child[i]);
+        pairs.push_back (std::make_pair (child[i], static_cast <size_t> (array_hot[from_hot].base ^ label)));
+      }
+  }
+  ccedar::hot_header h;
+  std::memcpy (h.magic, "JAGGERH", 8);
+  h.size = da_hot.size ();
+  h.da_digest = da_digest (da, nbytes);
+  image.resize (sizeof (h) + h.size * (sizeof (builder_t::node) + sizeof (int)));
+  std::memcpy (&image[0], &h, sizeof (h));
+  std::memcpy (&image[sizeof (h)], array_hot, h.size * sizeof (builder_t::node));
+  std::memcpy (&image[sizeof (h) + h.size * sizeof (builder_t::node)], &full[0], h.size * sizeof (int));
+}
+
+// labels of the previous POS that the tagger looks up (fi_prev); POS IDs
+// of patterns (p2f) and BOS
+static inline void pos_labels (const uint64_t* p2f, const size_t n, const size_t bos, std::vector <char>& is_pos) {
+  is_pos.assign (1 << MAX_KEY_BITS, 0);
+  is_pos[bos] = 1;
+  for (size_t i = 0; i < n; ++i)
+    is_pos[p2f[i] & ((1 << MAX_KEY_BITS) - 1)] = 1;
+}
+
+// build the POS-context table (ccedar::pos_table) of a trie image
+static inline void build_pos_table (const void* da, const size_t nbytes, const std::vector <char>& is_pos, std::vector <char>& image) {
+  typedef ccedar::da_builder <int, int, MAX_KEY_BITS> builder_t;
+  const builder_t::node* array = static_cast <const builder_t::node*> (da);
+  const size_t size = nbytes / sizeof (builder_t::node);
+  std::vector <size_t> head, child;
+  builder_t::children (array, size, head, child);
+  std::vector <uint32_t> offsets (size, 0);
+  std::vector <uint64_t> entries (1, 0); // empty list
+  std::vector <uint64_t> own, merged;
+  std::vector <std::pair <size_t, uint32_t> > stack (1, std::make_pair (0, 0)); // (node, list of parent)
+  while (! stack.empty ()) {
+    const size_t from = stack.back ().first;
+    const uint32_t inherited = stack.back ().second;
+    stack.pop_back ();
+    const int base = array[from].base;
+    bool valued = false;
+    own.clear ();
+    for (size_t i = head[from]; i < head[from + 1]; ++i) {
+      const size_t label = static_cast <size_t> (base ^ static_cast <int> (child[i]));
+      if (! label) {
+        valued = true;
+      } else if (is_pos[label]) { // pattern w/ POS context
+        const builder_t::node& t = array[array[child[i]].base];
+        if (t.check == static_cast <int> (child[i]))
+          own.push_back ((static_cast <uint64_t> (label) << 32) | static_cast <uint32_t> (t.base));
+      }
+    }
+    // the walk stops at a node with a value
+    const uint32_t parent = valued || ! from ? 0 : inherited;
+    if (own.empty ()) {
+      offsets[from] = parent;
+    } else {
+      std::sort (own.begin (), own.end ());
+      merged.assign (own.begin (), own.end ());
+      for (uint64_t k = 0; k < entries[parent]; ++k) { // nearer ones win
+        const uint64_t e = entries[parent + 1 + k];
+        size_t j = 0;
+        while (j < own.size () && (own[j] >> 32) != (e >> 32)) ++j;
+        if (j == own.size ()) merged.push_back (e);
+      }
+      std::sort (merged.begin (), merged.end ());
+      offsets[from] = static_cast <uint32_t> (entries.size ());
+      entries.push_back (merged.size ());
+      entries.insert (entries.end (), merged.begin (), merged.end ());
+    }
+    for (size_t i = head[from]; i < head[from + 1]; ++i) {
+      const size_t label = static_cast <size_t> (base ^ static_cast <int> (child[i]));
+      if (label && ! is_pos[label])
+        stack.push_back (std::make_pair (child[i], offsets[from]));
+    }
+  }
+  // index the nodes with a list; no image if none
+  image.clear ();
+  const size_t words = ccedar::pos_table::words (size);
+  std::vector <uint64_t> bits (words, 0);
+  std::vector <uint32_t> rank (words + (words & 1), 0), heads;
+  for (size_t i = 0; i < size; ++i) {
+    if (! (i & 63)) rank[i >> 6] = static_cast <uint32_t> (heads.size ());
+    if (offsets[i]) {
+      bits[i >> 6] |= static_cast <uint64_t> (1) << (i & 63);
+      heads.push_back (offsets[i]);
+    }
+  }
+  if (heads.empty ()) return;
+  const size_t nodes = heads.size ();
+  heads.resize (nodes + (nodes & 1), 0);
+  ccedar::pos_header h;
+  std::memcpy (h.magic, "JAGGERC", 8);
+  h.size = entries.size ();
+  h.nodes = nodes;
+  h.da_digest = da_digest (da, nbytes);
+  image.resize (ccedar::pos_table::nbytes (size, nodes, entries.size ()));
+  char* p = &image[0];
+  std::memcpy (p, &h, sizeof (h));                                    p += sizeof (h);
+  std::memcpy (p, &bits[0], bits.size () * sizeof (uint64_t));        p += bits.size () * sizeof (uint64_t);
+  std::memcpy (p, &rank[0], rank.size () * sizeof (uint32_t));        p += rank.size () * sizeof (uint32_t);
+  std::memcpy (p, &heads[0], heads.size () * sizeof (uint32_t));      p += heads.size () * sizeof (uint32_t);
+  std::memcpy (p, &entries[0], entries.size () * sizeof (uint64_t));
+}
+
+// visit counts of trie nodes recorded by jagger -P; accumulated over runs
+//   [profile_header][uint32_t x da_nodes]
+struct profile_header {
+  char     magic[8];  // "JAGGERP"
+  uint64_t da_nodes;
+  uint64_t da_digest; // da_digest () of the trie profiled
+};
+
+// compiles patterns (output of train_jagger) into the arrays of the tagger
+class model_compiler {
+public:
+  std::vector <uint16_t> c2i; // mapping from utf8, BOS, unk to character ID
+  std::vector <uint64_t> p2f; // mapping from pattern ID to feature strings
+  std::vector <char>     fs;  // feature strings
+  ccedar::da_builder <int, int, MAX_KEY_BITS> da; // pattern trie
+  typedef ccedar::da_builder <int, int, MAX_KEY_BITS> builder_t;
+  int layout; // order of placing trie nodes (builder_t::DFS, BFS, WEIGHTED)
+  size_t hot_budget;     // # nodes of the hot core (0: none)
+  std::vector <char> hot; // hot core image (m.hot)
+  std::vector <char> pos; // POS-context table image (m.pos)
+private:
+  typedef std::chrono::steady_clock clock;
+  const bool _verbose;
+  clock::time_point _start;
+  void _progress (const char* what, const size_t done, const size_t total) const {
+    if (! _verbose) return;
+    if (total) std::fprintf (stderr, "\r%s: %zu / %zu", what, done, total);
+    else       std::fprintf (stderr, "\r%s: %zu", what, done);
+  }
+  void _done (const char* what, const size_t n) {
+    const clock::time_point now = clock::now ();
+    if (_verbose)
+      std::fprintf (stderr, "\r%s: %zu done (%.3f sec)\n", what, n,
+                    std::chrono::duration <double> (now - _start).count ());
+    _start = now;
+  }
+public:
+  size_t da_bytes () const { return da.size () * sizeof (builder_t::node); }
+  model_compiler (const bool verbose = true, const int layout_ = builder_t::WEIGHTED) : c2i (), p2f (), fs (), da (), layout (layout_), hot_budget (0), hot (), pos (), _verbose (verbose), _start (clock::now ()) {}
+  void compile (const std::string& patterns) {
+    _start = clock::now ();
+    sbag_t fbag ("\tBOS");
+#ifdef USE_COMPACT_DICT
+    fbag.to_i (FEAT_UNK);
+    sbag_t fbag_ (",*,*,*\n");
+#else
+    sbag_t fbag_ ((std::string (FEAT_UNK) + ",*,*,*\n").c_str ());
+#endif
+    std::map <uint64_t, int> fs2pid;
+    fs2pid.insert (std::make_pair ((1ull << 32) | 2, fs2pid.size ()));
+    p2f.push_back ((1ull << 32) | 2);
+    // count each character to obtain dense mapping
+    std::vector <std::pair <size_t, int> > counter (CP_MAX + 3);
+    for (size_t u = 0; u < counter.size (); ++u) // allow 43 bits for counting
+      counter[u] = std::make_pair (0, u);
+    std::vector <std::pair <std::string, uint64_t> > keys;
+    std::vector <uint64_t> weights; // pattern counts; hot nodes are placed first
+    char *line = 0;
+    simple_reader reader (patterns.c_str ());
+    while (const size_t len = reader.gets (&line)) { // find pos offset
+      // pattern format: COUNT PATTEN PREV_POS BYTES CHAR_TYPE FEATURES
+      char *p (line), * const p_end (p + len);
+      const size_t count = std::strtoul (p, &p, 10);
+      const char *pat = ++p;
+      for (int b = 0; *p != '\t'; p += b)
+        counter[unicode (p, b)].first += count + 1;
+      size_t fi_prev = 0;
+      const char* f_prev = p; // starting with '\t'
+      if (*++p != '\t') { // with pos context
+        p = const_cast <char*> (skip_to (p, 1, '\t')) - 1;
+        fi_prev = fbag.to_i (f_prev, p - f_prev) + 1;
+        if (fi_prev + CP_MAX == counter.size ()) // new part-of-speech
+          counter.push_back (std::make_pair (0, (fi_prev + CP_MAX)));
+        counter[fi_prev + CP_MAX].first += count + 1;
+      }
+      const size_t bytes = std::strtoul (++p, &p, 10);
+      const size_t ctype = std::strtoul (++p, &p, 10);
+      const char* f = p; // starting with '\t'
+      p = const_cast <char*> (skip_to (p, NUM_POS_FIELD, ',')) - 1;
+      const size_t fi_  = fbag.to_i  (f, p - f) + 1;
+#ifndef USE_COMPACT_DICT
+      p = const_cast <char*> (f);
+#endif
+      const size_t fi = fbag_.to_i (p, p_end - p) + 1;
+      if (fi_ + CP_MAX == counter.size ()) // new part-of-speech
+        counter.push_back (std::make_pair (0, fi_ + CP_MAX));
+      std::pair <std::map <uint64_t, int>::iterator, bool> itb
+        = fs2pid.insert (std::make_pair ((fi << 32) | fi_, fs2pid.size ()));
+      if (itb.second) p2f.push_back ((fi << 32) | fi_);
+      keys.push_back (std::make_pair (std::string (pat, f_prev - pat),
+                                      (((bytes << 23) | ((ctype & 0x7) << 20) | (itb.first->second & 0xfffff)) << 12) | fi_prev));
+      weights.push_back (count + 1);
+      if ((keys.size () & 0xffff) == 0) _progress ("reading patterns", keys.size (), 0);
+    }
+    _done ("reading patterns", keys.size ());
+    // character mapping
+    std::sort (counter.begin () + 1, counter.end (), std::greater <std::pair <size_t, int> > ());
+    c2i.resize (counter.size ());
+    for (unsigned int i = 1; i < counter.size () && counter[i].first; ++i)
+      c2i[counter[i].second] = static_cast <uint16_t> (i);
+    // feature strings
+    std::vector <size_t> offsets;
+#ifdef USE_COMPACT_DICT
+    fbag.serialize  (fs, offsets); // required only for compact dict
+#endif
+    fbag_.serialize (fs, offsets);
+    // mapping from morpheme ID to morpheme feature strings
+    for (size_t i = 0; i < p2f.size (); ++i) {
+#ifdef USE_COMPACT_DICT
+      p2f[i] = (offsets[(p2f[i] >> 32) - 1 + fbag.size ()] << 34) |
+               (offsets[(p2f[i] & 0xffffffff) - 1] << MAX_KEY_BITS) |
+#else
+      const std::string& f = fbag_.to_s ((p2f[i] >> 32) - 1);
+      const char* q = skip_to (f.c_str (), NUM_POS_FIELD, ',') - 1;
+      p2f[i] = (offsets[(p2f[i] >> 32) - 1] << 34) |
+               (fbag_.to_s ((p2f[i] >> 32) - 1).size () << (MAX_KEY_BITS + MAX_FEATURE_BITS)) |
+               (q - f.c_str ()) << MAX_KEY_BITS |
+#endif
+               c2i[(p2f[i] & 0xffffffff) + CP_MAX];
+    }
+    _done ("mapping characters and features", p2f.size ());
+    // pattern trie; built at once from all the keys
+    builder_t::keys_t keys_ (keys.size ());
+    for (size_t i = 0; i < keys.size (); ++i) {
+      const std::string& pat = keys[i].first;
+      std::vector <unsigned int>& key = keys_[i].first;
+      for (size_t offset (0); offset < pat.size (); ) {
+        int b (0);
+        key.push_back (c2i[unicode (&pat[offset], b)]);
+        offset += static_cast <size_t> (b);
+      }
+      if (keys[i].second & 0xfff)
+        key.push_back (c2i[(keys[i].second & 0xfff) + CP_MAX]);
+      keys_[i].second = static_cast <int> (keys[i].second >> 12);
+      if (((i + 1) & 0xffff) == 0) _progress ("encoding keys", i + 1, keys.size ());
+    }
+    std::vector <std::pair <std::string, uint64_t> > ().swap (keys);
+    da.build (keys_, layout, &weights);
+    _done ("building trie", keys_.size ());
+    std::vector <char> is_pos;
+    pos_labels (&p2f[0], p2f.size (), c2i[CP_MAX + 1], is_pos);
+    build_pos_table (da.array (), da_bytes (), is_pos, pos);
+    _done ("building POS-context table", pos.size ());
+    if (hot_budget) { // by pattern counts
+      build_hot (da.array (), da_bytes (), da.weights (), hot_budget, hot);
+      _done ("building hot core", hot_budget);
+    }
+    c2i.resize (CP_MAX + 2); // chop most of part-of-speech mapping
+  }
+  // m.da, m.c2i, m.p2f, m.fs (and m.hot, m.pos); each file is replaced
+  // atomically and .da, whose presence marks a compiled model, is written
+  // last, but not the files as a set: a reader may pair a new .da with old
+  // .c2i/.p2f/.fs (.hot and .pos carry the digest of their .da and are
+  // ignored if it differs); .jgm is replaced as a whole
+  void save (const std::string& m) {
+    write_file_atomic (&fs[0], fs.size (), m + ".fs");
+    write_file_atomic (&p2f[0], p2f.size () * sizeof (uint64_t), m + ".p2f");
+    write_file_atomic (&c2i[0], c2i.size () * sizeof (uint16_t), m + ".c2i");
+    if (hot.empty ())
+      std::remove ((m + ".hot").c_str ()); // built for an old trie, if any
+    else
+      write_file_atomic (&hot[0], hot.size (), m + ".hot");
+    if (pos.empty ())
+      std::remove ((m + ".pos").c_str ()); // no POS-context patterns
+    else
+      write_file_atomic (&pos[0], pos.size (), m + ".pos");
+    write_file_atomic (da.array (), da_bytes (), m + ".da");
+    _done ("writing model", 4);
+  }
+  // re-layout a compiled trie (.da image) in the given order; pattern counts
+  // are not available here, so WEIGHTED is the same as BFS
+  void relayout (const void* array, const size_t nbytes) {
+    _start = clock::now ();
+    builder_t::keys_t keys;
+    builder_t::extract (static_cast <const builder_t::node*> (array), nbytes / sizeof (builder_t::node), keys);
+    _done ("reading trie", keys.size ());
+    da.build (keys, layout == builder_t::DFS ? builder_t::DFS : builder_t::BFS);
+    _done ("building trie", keys.size ());
+  }
+  // single .jgm file
+  uint64_t save_packed (const std::string& fn) {
+    std::vector <uint16_t> c2i_paged;
+    c2i_map::serialize (&c2i[0], c2i.size (), c2i_paged);
+    packed_model_writer writer;
+    writer.add (JGM_DA,  da.array (), da_bytes ());
+    writer.add (JGM_C2I_PAGED, &c2i_paged[0], c2i_paged.size () * sizeof (uint16_t));
+    writer.add (JGM_P2F, &p2f[0], p2f.size () * sizeof (uint64_t));
+    writer.add (JGM_FS,  &fs[0],  fs.size ());
+    if (! pos.empty ()) writer.add (JGM_POS, &pos[0], pos.size ());
+    if (! hot.empty ())
+      writer.add (JGM_HOT, &hot[0], hot.size ());
+    const uint64_t fingerprint = writer.save (fn);
+    _done ("writing packed model", 1);
+    return fingerprint;
+  }
+};
 #endif
@@ -4,13 +4,18 @@
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <sstream>
 #include <thread>
 
-// To increase portability, MMAP is off by default.
-// #defined JAGGER_USE_MMAP_IO
+// JAGGER_USE_MMAP_IO is defined by setup.py/CMakeLists.txt on non-Windows
+// platforms. Model files are then used directly from the page cache and shared
+// among processes.
 
 #include "jagger.h"
 
@@ -429,154 +434,354 @@ static inline bool is_line_ending(const char *p, size_t i, size_t end_i) {
   return false;
 }
 
+// '\n', '\0', or '\r' not followed by '\n'; "\r\n" is broken at '\n'.
+static inline bool is_line_break(const char *buffer, size_t i, size_t length) {
+  const char c = buffer[i];
+  return c == '\n' || c == '\0' ||
+         (c == '\r' && (i + 1 == length || buffer[i + 1] != '\n'));
+}
+
+//
+// Return: Offset of the first byte that does not start a valid UTF-8 sequence
+// (RFC 3629; no overlong forms, surrogates or code points over U+10FFFF) in
+// `buffer`, or `length` if all of it is valid.
+//
+// The tagger assumes valid UTF-8, so bytes from buffer objects and files are
+// checked first(str is valid by construction).
+//
+static size_t find_invalid_utf8(const char *buffer, size_t length) {
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(buffer);
+  size_t i = 0;
+  while (i < length) {
+    uint64_t word;
+    if (length - i >= 8 &&
+        (std::memcpy(&word, p + i, 8), !(word & 0x8080808080808080ULL))) {
+      i += 8;  // ASCII
+      continue;
+    }
+    const unsigned int c = p[i];
+    if (c < 0x80) {
+      i++;
+      continue;
+    }
+    size_t n = 0;  // # continuation bytes
+    unsigned int lo = 0x80, hi = 0xbf;  // range of the second byte
+    if (c >= 0xc2 && c <= 0xdf) {
+      n = 1;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      n = 2;
+      if (c == 0xe0) lo = 0xa0;  // overlong
+      if (c == 0xed) hi = 0x9f;  // surrogates
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      n = 3;
+      if (c == 0xf0) lo = 0x90;  // overlong
+      if (c == 0xf4) hi = 0x8f;  // > U+10FFFF
+    } else {
+      return i;
+    }
+    if (length - i <= n || p[i + 1] < lo || p[i + 1] > hi) return i;
+    for (size_t k = 2; k <= n; k++) {
+      if ((p[i + k] & 0xc0) != 0x80) return i;
+    }
+    i += n + 1;
+  }
+  return length;
+}
+
 struct LineInfo {
   size_t pos{0};
   size_t len{0};
 };
 
-using LineInfoVector = StackVector<std::vector<LineInfo>, kMaxThreads>;
+// a line in one of the input buffers(e.g., an item of a list)
+struct LineRef {
+  const char *ptr;
+  size_t len;
+};
 
-//
-// Return: List of address of line begin/end in `src`.
-//
-static LineInfoVector split_lines(const std::string &src,
-                                  uint32_t req_nthreads = 0) {
-  // From nanocsv. https://github.com/lighttransport/nanocsv
+// Minimum bytes per thread when splitting lines.
+constexpr size_t kMinSplitChunk = 1 << 16;
 
-  uint32_t num_threads = (req_nthreads == 0)
-                             ? uint32_t(std::thread::hardware_concurrency())
-                             : req_nthreads;
-  num_threads = (std::max)(
-      1u, (std::min)(static_cast<uint32_t>(num_threads), kMaxThreads));
+// Cost of tagging a line in bytes on top of its length, and the cost of
+// lines a thread takes at once(at least) in tokenize_batch.
+constexpr size_t kLineCost = 64;
+constexpr size_t kMinChunkCost = 1 << 14;
 
-  const size_t buffer_length = src.size();
-  const char *buffer = src.c_str();
+// Bytes of a block of lines read from a file(tokenize_file), and the # blocks
+// read ahead.
+constexpr size_t kFileBlockBytes = 1 << 22;
+constexpr size_t kFileBlocks = 4;
 
-  LineInfoVector line_infos;
-  line_infos->resize(kMaxThreads);
+// a line of this size or longer is tagged with multiple threads(see
+// set_split_threshold); pieces are kMinPieceBytes or more.
+constexpr size_t kSplitThreshold = 1 << 18;
+constexpr size_t kMinPieceBytes = 1 << 14;
 
-  for (size_t t = 0; t < static_cast<size_t>(num_threads); t++) {
-    // Pre allocate enough memory. len / 128 / num_threads is just a heuristic
-    // value.
-    line_infos[t].reserve(buffer_length / 128 / size_t(num_threads));
+//
+// Calls emit(pos, len) for each non-empty line whose break is in [begin, end)
+// of the buffer; the last line without a break goes to the range at the end.
+// The trailing '\r' of "\r\n" is not a part of the line.
+//
+template <typename F>
+static void scan_lines(const char *buffer, size_t length, size_t begin,
+                       size_t end, F emit) {
+  const line_break_finder_t find = line_break_finder();
+  // the line may start in the previous range; found on the first break.
+  size_t pos = begin;
+  bool pos_found = (begin == 0);
+  auto line_start = [&]() {
+    if (!pos_found) {
+      while (pos > 0 && !is_line_break(buffer, pos - 1, length)) pos--;
+      pos_found = true;
+    }
+  };
+  for (const char *p = buffer + begin, *const e = buffer + end;; p++) {
+    if ((p = find(p, e)) == e) break;
+    const size_t i = size_t(p - buffer);
+    if (*p == '\r' && i + 1 < length && buffer[i + 1] == '\n') continue;
+    line_start();
+    const size_t len =
+        i - pos - ((*p == '\n' && i > pos && buffer[i - 1] == '\r') ? 1 : 0);
+    if (len > 0) emit(pos, len);
+    pos = i + 1;
+    pos_found = true;
+  }
+  if (end == length) {
+    line_start();
+    if (pos < length) emit(pos, length - pos);
   }
+}
 
-  // Find newline('\n', '\r' or '\r\n') and create line data.
-  {
-    StackVector<std::thread, kMaxThreads> workers;
+//
+// Long-lived worker threads owned by PyJagger; shared by the batch APIs so
+// that a call does not create and join threads.
+//
+// run(n, f) calls f(0), ..., f(n - 1) on the workers and the calling thread,
+// and returns when all of them are done. When another call is running on the
+// pool(from another Python thread), the tasks run in the calling thread.
+//
+class ThreadPool {
+ public:
+  // nthreads: # threads to run tasks, including the calling thread.
+  explicit ThreadPool(uint32_t nthreads) {
+    for (uint32_t t = 1; t < nthreads; t++) {
+      _workers.emplace_back(&ThreadPool::work, this);
+    }
+  }
 
-    auto chunk_size = buffer_length / size_t(num_threads);
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _wake.notify_all();
+    for (auto &worker : _workers) {
+      worker.join();
+    }
+  }
+
+  uint32_t size() const { return uint32_t(_workers.size()) + 1; }
 
-    // input is too small. use single-threaded parsing
-    if (buffer_length < size_t(num_threads)) {
-      num_threads = 1;
-      chunk_size = buffer_length;
+  void run(size_t n, const std::function<void(size_t)> &f) {
+    std::unique_lock<std::mutex> busy(_busy, std::try_to_lock);
+    if (!busy.owns_lock() || _workers.empty() || n <= 1) {
+      for (size_t i = 0; i < n; i++) {
+        f(i);
+      }
+      return;
     }
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _task = &f;
+      _num_tasks = n;
+      _next = 0;
+      _pending = n;
+      _generation++;
+    }
+    _wake.notify_all();
+    run_tasks(&f, n);
+    std::unique_lock<std::mutex> lock(_mutex);
+    // wait for workers that joined this call to leave, too
+    _done.wait(lock, [this]() { return _pending == 0 && _active == 0; });
+    _task = nullptr;
+  }
 
-    for (size_t t = 0; t < static_cast<size_t>(num_threads); t++) {
-      workers->push_back(std::thread([&, t]() {
-        auto start_idx = (t + 0) * chunk_size;
-        auto end_idx = (std::min)((t + 1) * chunk_size, buffer_length - 1);
-        if (t == static_cast<size_t>((num_threads - 1))) {
-          end_idx = buffer_length - 1;
+  //
+  // Calls f(begin, end) over items [0, n), where cost(i) is the total cost
+  // (e.g., bytes) of items [0, i) (non-decreasing; i <= n). Each thread starts
+  // from a contiguous range of about equal cost, takes chunks from its head
+  // that shrink as the range drains(a quarter of the rest, but >= min_cost),
+  // and steals chunks from the ranges of the others when done.
+  //
+  template <typename Cost>
+  void parallel_for(size_t n, Cost cost, size_t min_cost,
+                    const std::function<void(size_t, size_t)> &f) {
+    const size_t total = cost(n) - cost(0);
+    const size_t num_ranges = (std::min)(size_t(size()), n);
+    if (num_ranges <= 1 || total <= min_cost) {
+      if (n) f(0, n);
+      return;
+    }
+    // first item in [lo, hi) with cost(i) >= c(hi if none)
+    auto lower_bound = [&cost](size_t lo, size_t hi, size_t c) {
+      while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (cost(mid) < c) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
         }
-
-        // true if the line currently read must be added to the current line
-        // info
-        bool new_line_found =
-            (t == 0) || is_line_ending(buffer, start_idx - 1, end_idx);
-
-        size_t prev_pos = start_idx;
-        for (size_t i = start_idx; i < end_idx; i++) {
-          if (is_line_ending(buffer, i, end_idx)) {
-            if (!new_line_found) {
-              // first linebreak found in (chunk > 0), and a line before this
-              // linebreak belongs to previous chunk, so skip it.
-              prev_pos = i + 1;
-              new_line_found = true;
-            } else {
-              LineInfo info;
-              info.pos = prev_pos;
-              info.len = i - prev_pos;
-
-              if (info.len > 0) {
-                line_infos[t].push_back(info);
-              }
-
-              prev_pos = i + 1;
-            }
+      }
+      return lo;
+    };
+    std::vector<Range> ranges(num_ranges);
+    for (size_t t = 0, begin = 0; t < num_ranges; t++) {
+      const size_t end =
+          (t + 1 == num_ranges)
+              ? n
+              : lower_bound(begin, n, cost(0) + total / num_ranges * (t + 1));
+      ranges[t].next = begin;
+      ranges[t].end = end;
+      begin = end;
+    }
+    run(num_ranges, [&](size_t t) {
+      for (size_t i = 0; i < num_ranges; i++) {
+        Range &r = ranges[(t + i) % num_ranges];  // own range first
+        size_t begin = r.next.load();
+        while (begin < r.end) {
+          const size_t want =
+              (std::max)(min_cost, (cost(r.end) - cost(begin)) / 4);
+          const size_t end =
+              (std::max)(begin + 1, lower_bound(begin, r.end, cost(begin) + want));
+          if (r.next.compare_exchange_weak(begin, end)) {
+            f(begin, end);
+            begin = end;
           }
         }
+      }
+    });
+  }
 
-        // If at least one line started in this chunk, find where it ends in the
-        // rest of the buffer
-        if (new_line_found && (t < size_t(num_threads)) &&
-            (buffer[end_idx - 1] != '\n')) {
-          for (size_t i = end_idx; i < buffer_length; i++) {
-            if (is_line_ending(buffer, i, buffer_length)) {
-              LineInfo info;
-              info.pos = prev_pos;
-              info.len = i - prev_pos;
-
-              if (info.len > 0) {
-                line_infos[t].push_back(info);
-              }
-
-              break;
-            }
-          }
-        }
-      }));
+ private:
+  // padded to a cache line, so the `next` of two ranges are never on one
+  // line(alignas is not honored by new in C++11)
+  struct Range {
+    std::atomic<size_t> next{0};
+    size_t end{0};
+    char pad[64 - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+  };
+
+  void run_tasks(const std::function<void(size_t)> *task, size_t n) {
+    size_t done = 0;
+    for (size_t i; (i = _next++) < n; done++) {
+      (*task)(i);
     }
+    if (done) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _pending -= done;
+    }
+  }
 
-    for (size_t t = 0; t < workers->size(); t++) {
-      workers[t].join();
+  void work() {
+    uint64_t generation = 0;
+    for (;;) {
+      const std::function<void(size_t)> *task;
+      size_t n;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _wake.wait(lock, [&]() {
+          return _stop || (_task && _generation != generation);
+        });
+        if (_stop) return;
+        generation = _generation;
+        task = _task;
+        n = _num_tasks;
+        _active++;
+      }
+      run_tasks(task, n);
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _active--;
+      }
+      _done.notify_all();
     }
   }
 
-  return line_infos;
+  std::vector<std::thread> _workers;
+  std::mutex _busy;   // held by the running call
+  std::mutex _mutex;  // guards the members below
+  std::condition_variable _wake, _done;
+  const std::function<void(size_t)> *_task{nullptr};
+  size_t _num_tasks{0};
+  std::atomic<size_t> _next{0};
+  size_t _pending{0};  // # tasks not done yet
+  size_t _active{0};   // # workers in the call
+  uint64_t _generation{0};
+  bool _stop{false};
+};
+
+#if !defined(_WIN32)
+//
+// Pools inherited from the parent process over fork()(e.g., multiprocessing).
+// Their worker threads do not exist in the child, so ~ThreadPool would wait
+// forever to join them(or lock a mutex held by a thread that is gone). They
+// are moved here and never destroyed; the holder itself is not freed at exit
+// for the same reason. One pool per fork leaks by design.
+//
+static std::vector<std::shared_ptr<ThreadPool>> &forked_pools() {
+  static std::vector<std::shared_ptr<ThreadPool>> *pools =
+      new std::vector<std::shared_ptr<ThreadPool>>();
+  return *pools;
+}
+#endif
+
+//
+// Return: List of lines in `src`(delimited by '\n', '\r' or '\r\n').
+//
+// Threads count the lines of their ranges first, and then write them into
+// the flat array at the offsets.
+//
+static std::vector<LineInfo> split_lines(const char *buffer, size_t length,
+                                         ThreadPool &pool) {
+  const size_t num_threads =
+      (std::min)(size_t(pool.size()), length / kMinSplitChunk + 1);
+
+  const size_t chunk_size = length / num_threads;
+  auto chunk_begin = [&](size_t t) { return t * chunk_size; };
+  auto chunk_end = [&](size_t t) {
+    return (t + 1 == num_threads) ? length : (t + 1) * chunk_size;
+  };
+
+  std::vector<size_t> offsets(num_threads + 1, 0);
+  std::vector<LineInfo> lines;
+
+  pool.run(num_threads, [&](size_t t) {
+    size_t n = 0;
+    scan_lines(buffer, length, chunk_begin(t), chunk_end(t),
+               [&n](size_t, size_t) { n++; });
+    offsets[t + 1] = n;
+  });
+  for (size_t t = 0; t < num_threads; t++) {
+    offsets[t + 1] += offsets[t];
+  }
+  lines.resize(offsets[num_threads]);
+  pool.run(num_threads, [&](size_t t) {
+    LineInfo *dst = lines.data() + offsets[t];
+    scan_lines(buffer, length, chunk_begin(t), chunk_end(t),
+               [&dst](size_t pos, size_t len) {
+                 dst->pos = pos;
+                 dst->len = len;
+                 dst++;
+               });
+  });
+
+  return lines;
 }
 
 }  // namespace
 
 // jagger.cc(with some modification) BEGIN --------------------
 
-static const size_t MAX_KEY_BITS = 14;
-static const size_t MAX_FEATURE_BITS = 7;
-
-namespace ccedar {
-class da_ : public ccedar::da<int, int, MAX_KEY_BITS> {
- public:
-  struct utf8_feeder {  // feed one UTF-8 character by one while mapping codes
-    const char *p, *const end;
-    utf8_feeder(const char *key_, const char *end_) : p(key_), end(end_) {}
-    int read(int &b) const { return p == end ? 0 : unicode(p, b); }
-    void advance(const int b) { p += b; }
-  };
-  int longestPrefixSearchWithPOS(const char *key, const char *const end,
-                                 int fi_prev, const uint16_t *const c2i,
-                                 size_t from = 0) const {
-    size_t from_ = 0;
-    int n(0), i(0), b(0);
-    for (utf8_feeder f(key, end); (i = c2i[f.read(b)]); f.advance(b)) {
-      size_t pos = 0;
-      const int n_ = traverse(&i, from, pos, pos + 1);
-      if (n_ == CEDAR_NO_VALUE) continue;
-      if (n_ == CEDAR_NO_PATH) break;
-      from_ = from;
-      n = n_;
-    }
-    // ad-hock matching at the moment; it prefers POS-ending patterns
-    if (!fi_prev) return n;
-    for (const node *const array_ = reinterpret_cast<const node *>(array());;
-         from = array_[from].check) {  // hopefully, in the cache
-      const int n_ = exactMatchSearch<int>(&fi_prev, 1, from);
-      if (n_ != CEDAR_NO_VALUE) return n_;
-      if (from == from_) return n;
-    }
-  }
-};
-}  // namespace ccedar
 namespace jagger {
 
 namespace {
@@ -620,12 +825,14 @@ inline std::vector<std::string> split(
 // Support quoted string'\"' (do not consider `delimiter` character in quoted string)
 // delimiter must be a ASCII char.
 // quote_char must be a single UTF-8 char.
-inline std::vector<std::string> parse_feature(const char *p, const size_t len, const char delimiter = ',', const char *quote_char = "\"")
+// Fields are stored as their end offsets; the i-th field is
+// [(i ? ends[i - 1] + 1 : 0), ends[i]).
+inline void split_feature(const char *p, const size_t len, std::vector<uint32_t> &ends, const char delimiter = ',', const char *quote_char = "\"")
 {
-  std::vector<std::string> tokens;
+  ends.clear();
 
   if (len == 0) {
-    return tokens;
+    return;
   }
 
   size_t quote_size = u8_len(quote_char);
@@ -651,165 +858,140 @@ inline std::vector<std::string> parse_feature(const char *p, const size_t len, c
     }
 
     if (!in_quoted_string && (p[i] == delimiter)) {
-      //std::cout << "s_start = " << s_start << ", (i-1) = " << i-1 << "\n";
-      //std::cout << "p[i] = " << p[i] << "\n";
-      if (s_start < i) {
-        std::string tok(p + s_start, i - s_start);
-
-        tokens.push_back(tok);
-      } else {
-        // Add empty string
-        tokens.push_back(std::string());
-      }
+      // an empty field when s_start == i
+      ends.push_back(uint32_t(i));
 
       s_start = i + 1; // next to delimiter char
     }
   }
 
   // the remainder
-  //std::cout << "remain: s_start = " << s_start << ", len - 1 = " << len-1 << "\n";
-
   if (s_start <= (len - 1)) {
-    std::string tok(p + s_start, len - s_start);
-    tokens.push_back(tok);
+    ends.push_back(uint32_t(len));
   }
-
-  return tokens;
 }
 
-} // namespace
-
-
-
-class PyToken {
- public:
-  PyToken() = default;
-
-  // TODO: Use string_view?
-  const std::string &surface() const { return _surface; }
+inline std::vector<std::string> parse_feature(const char *p, const size_t len, const char delimiter = ',', const char *quote_char = "\"")
+{
+  std::vector<uint32_t> ends;
+  split_feature(p, len, ends, delimiter, quote_char);
 
-  std::string &get_surface() { return _surface; }
+  std::vector<std::string> tokens;
+  tokens.reserve(ends.size());
+  for (size_t i = 0; i < ends.size(); i++) {
+    const size_t s = i ? ends[i - 1] + 1 : 0;
+    tokens.push_back(std::string(p + s, ends[i] - s));
+  }
 
-  // comma separated feature
-  // TODO: Use string_view when compiled with C++17
-  const std::string &feature() const { return _feature; }
+  return tokens;
+}
 
-  // NOTE: feature string contains leading whitespaces.
-  std::string &get_feature() { return _feature; }
+} // namespace
 
-  void set_quote_char(const std::string &quote_char) {
-    _quote_char = quote_char;
-  }
 
-  uint32_t n_tags() const {
-    if (_feature.empty()) {
-      return 0;
-    }
 
-    // cache result.
-    if (_tags.empty()) {
-      // remove leading whitespaces.
-      std::string trimmed_string = ltrim(_feature);
+// feature ID of a token of concatenated words(the feature is "POS,*,*,*")
+constexpr uint32_t kConcatFeature = 1u << 31;
 
-      _tags = parse_feature(trimmed_string.data(), trimmed_string.size(), ',', _quote_char.c_str());
-    }
+// tokens in columns(tokenize_batch_arrays); begin/end are byte offsets in the
+// input, and feature is p2f index(| kConcatFeature)
+struct token_columns {
+  std::vector<int64_t> begin;
+  std::vector<int64_t> end;
+  std::vector<uint32_t> feature;
 
-    return _tags.size();
-  }
+  size_t size() const { return feature.size(); }
+};
 
-  // TODO: use string_view
-  std::string tag(uint32_t idx) const {
-    if (idx < n_tags()) {
-      return _tags[idx];
-    }
-    return std::string();
+// sink of tag_line(jagger.h) appending tokens to token_columns; offsets are
+// relative to line + base
+struct column_writer {
+  token_columns &out;
+  size_t base;
+
+  void operator()(const size_t begin, const size_t end, const int r,
+                  const bool concat) {
+    out.begin.push_back(int64_t(base + begin));
+    out.end.push_back(int64_t(base + end));
+    out.feature.push_back(uint32_t(r & 0xfffff) |
+                          (concat ? kConcatFeature : 0));
   }
+};
 
-  const std::string str() {
-    return _surface + "\t" + _feature;
+// fields following POS in the feature of concatenated words
+static const char kConcatFields[] = ",*,*,*";
+
+// fields(tags) of a feature; the feature is [p, p + n) in the model,
+// followed by kConcatFields for concatenated words. The i-th field is
+// [(i ? ends[i] + 1 : 0), ends[i + 1]) with ends[0] = # fields.
+struct feature_fields {
+  const char *p;
+  size_t n;
+  const uint16_t *ends;
+
+  size_t size() const { return ends[0]; }
+  std::string at(const size_t i) const {
+    const size_t s = i ? ends[i] + 1u : 0, e = ends[i + 1];
+    std::string f;
+    if (s < n) f.assign(p + s, std::min(e, n) - s);
+    if (e > n) f.append(kConcatFields + (std::max(s, n) - n), e - std::max(s, n));
+    return f;
   }
-
- private:
-  std::string _surface;
-
-  // TODO: Use string_view when compiled with C++17
-  std::string _feature;
-  mutable std::vector<std::string> _tags;
-  std::string _quote_char = "\"";
 };
 
 class tagger {
  private:
   ccedar::da_ da;
-  const uint16_t *c2i{nullptr};  // mapping from utf8, BOS, unk to character ID
+  c2i_map c2i;                   // mapping from utf8, BOS, unk to character ID
   const uint64_t *p2f{nullptr};  // mapping from pattern ID to feature strings
   const char *fs{nullptr};       // feature strings
+  size_t _num_features{0};       // # entries of p2f
+  // field ends(feature_fields::ends) by feature ID(+ _num_features for
+  // concatenated words); filled on first access
+  mutable std::unique_ptr<std::atomic<const uint16_t *>[]> _fields;
+  mutable std::once_flag _fields_once;
 
 #if defined(JAGGER_USE_MMAP_IO)
   std::vector<std::pair<void *, size_t>> mmaped;
 #else
-  std::vector<uint8_t> buffers[4];  // up to 4 dicts
+  std::vector<uint8_t> buffers[6];  // 4 dicts + hot core + POS contexts
 #endif
 
-  static inline void write_string(char *&p, const char *s, size_t len = 0) {
-#ifdef USE_COMPACT_DICT
-    if (!len) {
-      len = *reinterpret_cast<const uint16_t *>(s);
-      s += sizeof(uint16_t);
-    }
-#endif
-    std::memcpy(p, s, len);
-    p += len;
-  }
-
-#if 0
-  static inline std::string to_string(char *curr_p, char *start_p) {
-    if (curr_p > start_p) {
-      std::string(start_p, static_cast<size_t>(curr_p - start_p));
-    }
-    return std::string();
-  }
-#endif
-
-  static inline void write_buffer(char *&p, char *buf, const size_t limit) {
-    if (ptrdiff_t(p - buf) <= ptrdiff_t(limit)) return;
-    ::write(1, buf, static_cast<size_t>(p - buf));
-    p = buf;
-  }
-  template <typename T>
-  static inline void write_array(T &data, const std::string &fn) {
-    FILE *fp = std::fopen(fn.c_str(), "wb");
-    if (!fp) my_errx(1, "no such file: %s", fn.c_str());
-    std::fwrite(&data[0], sizeof(typename T::value_type), data.size(), fp);
-    std::fclose(fp);
-  }
   const void *read_array(const std::string &fn, size_t idx, size_t &len) {
 #if defined(JAGGER_USE_MMAP_IO)
     (void)idx;
     int fd = ::open(fn.c_str(), O_RDONLY);
-    if (fd == -1) my_errx(1, "no such file: %s", fn.c_str());
+    if (fd == -1) {
+      py::print("Failed to open file: ", fn);
+      return nullptr;
+    }
     // get size and read;
     const size_t size = ::lseek(fd, 0, SEEK_END);
     ::lseek(fd, 0, SEEK_SET);
+    if (size == 0) {
+      py::print("File is empty: ", fn);
+      ::close(fd);
+      return nullptr;
+    }
 #if defined(_WIN32)
     HANDLE hFile = reinterpret_cast<HANDLE>(_get_osfhandle(fd));
     HANDLE hMapping =
         CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
-    if (hMapping == NULL) {
-      my_errx(1, "CreateFileMappingA failed for: %s", fn.c_str());
-    }
-    void *data = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    void *data = hMapping ? MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0)
+                          : nullptr;
+    if (hMapping) CloseHandle(hMapping);
+    ::close(fd);
     if (!data) {
-      my_errx(1, "MapViewOfFile failed for: %s", fn.c_str());
+      py::print("MapViewOfFile failed for: ", fn);
+      return nullptr;
     }
-    CloseHandle(hMapping);
 #else
-    void *data{nullptr};  // = ::mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    void *data = ::mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);  // the mapping stays valid after close()
     if (data == MAP_FAILED) {
-      my_errx(1, "mmap failed for: %s", fn.c_str());
+      py::print("mmap failed for: ", fn);
+      return nullptr;
     }
-    // close() causes segmentation fault for some reason, so
-    ::close(fd);
 #endif
     mmaped.push_back(std::make_pair(data, size));
     len = size;
@@ -821,18 +1003,32 @@ class tagger {
       py::print("Failed to read file: ", err);
       return nullptr;
     }
-    buffers[idx] = data;
+    buffers[idx].swap(data);
 
-    len = data.size();
+    len = buffers[idx].size();
     // Assume pointer address does not change.
     return reinterpret_cast<const void *>(buffers[idx].data());
+#endif
+  }
+  // release the array last read by read_array(idx)
+  void release_array(size_t idx) {
+#if defined(JAGGER_USE_MMAP_IO)
+    (void)idx;
+#if defined(_WIN32)
+    UnmapViewOfFile(mmaped.back().first);
+#else
+    ::munmap(mmaped.back().first, mmaped.back().second);
+#endif
+    mmaped.pop_back();
+#else
+    std::vector<uint8_t>().swap(buffers[idx]);
 #endif
   }
 
  public:
   tagger()
       : da(),
-        c2i(0),
+        c2i(),
         p2f(0),
         fs(0)
 #if defined(JAGGER_USE_MMAP_IO)
@@ -842,6 +1038,9 @@ class tagger {
   {
   }
   ~tagger() {
+    if (_fields) {
+      for (size_t i = 0; i < 2 * _num_features; i++) delete[] _fields[i].load();
+    }
 #if defined(JAGGER_USE_MMAP_IO)
     for (size_t i = 0; i < mmaped.size(); ++i)
 #if defined(_WIN32)
@@ -853,113 +1052,77 @@ class tagger {
 #endif
 #endif
   }
-  bool read_model(const std::string &m) {  // read patterns to memory
+  // single-file model(.jgm). all arrays are loaded with one read/mmap.
+  bool read_packed_model(const std::string &fn) {
+    size_t size{0}, da_size{0}, c2i_size{0};
+    const void *data = read_array(fn, 0, size);
+    if (!data) {
+      py::print("Failed to read packed model:", fn);
+      return false;
+    }
+    packed_model pm;
+    if (const char *err = pm.open(data, size)) {
+      py::print("Invalid packed model:", fn, err);
+      return false;
+    }
+    const void *da_buf = pm.section(JGM_DA, da_size);
+    const void *c2i_buf = pm.section(JGM_C2I_PAGED, c2i_size);
+    if (c2i_buf) {
+      if (!c2i.set_array(c2i_buf, c2i_size)) {
+        py::print("Corrupted character mapping in packed model:", fn);
+        return false;
+      }
+      advise_section(c2i_buf, c2i_size, /* random */ true);
+    } else if ((c2i_buf = pm.section(JGM_C2I, c2i_size))) {
+      // flat table(packed by older jagger-pack)
+      c2i.build(static_cast<const uint16_t *>(c2i_buf),
+                c2i_size / sizeof(uint16_t));
+    }
+    p2f = static_cast<const uint64_t *>(pm.section(JGM_P2F, size));
+    _num_features = size / sizeof(uint64_t);
+    fs = static_cast<const char *>(pm.section(JGM_FS, size));
+    if (!da_buf || !c2i_buf || !p2f || !fs) {
+      py::print("Missing section in packed model:", fn);
+      return false;
+    }
+    da.set_array(da_buf, da_size);
+    advise_section(da_buf, da_size, /* random */ true);
+    if (const void *hot = pm.section(JGM_HOT, size)) {
+      if (!da.set_hot(hot, size)) {
+        py::print("Corrupted hot core in packed model:", fn);
+        return false;
+      }
+      advise_section(hot, size, /* random */ false);
+    }
+    if (const void *pos = pm.section(JGM_POS, size)) {
+      if (!da.set_pos(pos, size)) {
+        py::print("Corrupted POS-context table in packed model:", fn);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // strict: do not compile patterns when the model is not compiled yet.
+  bool read_model(const std::string &m,
+                  bool strict = false) {  // read patterns to memory
+    const std::string jgm_fn(
+        (m.size() > 4 && m.compare(m.size() - 4, 4, ".jgm") == 0) ? m
+                                                                  : m + ".jgm");
+    if (FileExists(jgm_fn)) {
+      return read_packed_model(jgm_fn);
+    }
     const std::string da_fn(m + ".da"), c2i_fn(m + ".c2i"), p2f_fn(m + ".p2f"),
         fs_fn(m + ".fs");
-    // struct stat st;
-    // if (::stat (da_fn.c_str (), &st) != 0) { // compile
     if (!FileExists(da_fn)) {
-      py::print("building DA trie from patterns..");
-      std::vector<uint16_t> c2i_;  // mapping from utf8, BOS, unk to char ID
-      std::vector<uint64_t> p2f_;  // mapping from pattern ID to feature str
-      std::vector<char> fs_;       // feature strings
-      sbag_t fbag("\tBOS");
-#ifdef USE_COMPACT_DICT
-      fbag.to_i(FEAT_UNK);
-      sbag_t fbag_(",*,*,*\n");
-#else
-      sbag_t fbag_((std::string(FEAT_UNK) + ",*,*,*\n").c_str());
-#endif
-      std::map<uint64_t, int> fs2pid;
-      fs2pid.insert(std::make_pair((1ull << 32) | 2, fs2pid.size()));
-      p2f_.push_back((1ull << 32) | 2);
-      // count each character to obtain dense mapping
-      std::vector<std::pair<size_t, int>> counter(CP_MAX + 3);
-      for (size_t u = 0; u < counter.size(); ++u)  // allow 43 bits for counting
-        counter[u] = std::make_pair(0, u);
-      std::vector<std::pair<std::string, uint64_t>> keys;
-      char *line = 0;
-      simple_reader reader(m.c_str());
-      while (const size_t len = reader.gets(&line)) {  // find pos offset
-        // pattern format: COUNT PATTEN PREV_POS BYTES CHAR_TYPE FEATURES
-        char *p(line), *const p_end(p + len);
-        const size_t count = std::strtoul(p, &p, 10);
-        const char *pat = ++p;
-        for (int b = 0; *p != '\t'; p += b)
-          counter[unicode(p, b)].first += count + 1;
-        size_t fi_prev = 0;
-        const char *f_prev = p;  // starting with '\t'
-        if (*++p != '\t') {      // with pos context
-          p = const_cast<char *>(skip_to(p, 1, '\t')) - 1;
-          fi_prev = fbag.to_i(f_prev, p - f_prev) + 1;
-          if (fi_prev + CP_MAX == counter.size())  // new part-of-speech
-            counter.push_back(std::make_pair(0, (fi_prev + CP_MAX)));
-          counter[fi_prev + CP_MAX].first += count + 1;
-        }
-        const size_t bytes = std::strtoul(++p, &p, 10);
-        const size_t ctype = std::strtoul(++p, &p, 10);
-        const char *f = p;  // starting with '\t'
-        p = const_cast<char *>(skip_to(p, NUM_POS_FIELD, ',')) - 1;
-        const size_t fi_ = fbag.to_i(f, p - f) + 1;
-#ifndef USE_COMPACT_DICT
-        p = const_cast<char *>(f);
-#endif
-        const size_t fi = fbag_.to_i(p, p_end - p) + 1;
-        if (fi_ + CP_MAX == counter.size())  // new part-of-speech
-          counter.push_back(std::make_pair(0, fi_ + CP_MAX));
-        std::pair<std::map<uint64_t, int>::iterator, bool> itb =
-            fs2pid.insert(std::make_pair((fi << 32) | fi_, fs2pid.size()));
-        if (itb.second) p2f_.push_back((fi << 32) | fi_);
-        keys.push_back(std::make_pair(std::string(pat, f_prev - pat),
-                                      (((bytes << 23) | ((ctype & 0x7) << 20) |
-                                        (itb.first->second & 0xfffff))
-                                       << 12) |
-                                          fi_prev));
+      if (strict) {
+        py::print("Model is not compiled(run jagger-compile):", m);
+        return false;
       }
-      // save c2i
-      std::sort(counter.begin() + 1, counter.end(),
-                std::greater<std::pair<size_t, int>>());
-      c2i_.resize(counter.size());
-      for (unsigned int i = 1; i < counter.size() && counter[i].first; ++i)
-        c2i_[counter[i].second] = static_cast<uint16_t>(i);
-      // save feature strings
-      std::vector<size_t> offsets;
-#ifdef USE_COMPACT_DICT
-      fbag.serialize(fs_, offsets);  // required only for compact dict
-#endif
-      fbag_.serialize(fs_, offsets);
-      write_array(fs_, fs_fn);
-      // save mapping from morpheme ID to morpheme feature strings
-      for (size_t i = 0; i < p2f_.size(); ++i) {
-#ifdef USE_COMPACT_DICT
-        p2f_[i] = (offsets[(p2f_[i] >> 32) - 1 + fbag.size()] << 34) |
-                  (offsets[(p2f_[i] & 0xffffffff) - 1] << MAX_KEY_BITS) |
-#else
-        const std::string &f = fbag_.to_s((p2f_[i] >> 32) - 1);
-        const char *q = skip_to(f.c_str(), NUM_POS_FIELD, ',') - 1;
-        p2f_[i] = (offsets[(p2f_[i] >> 32) - 1] << 34) |
-                  (fbag_.to_s((p2f_[i] >> 32) - 1).size()
-                   << (MAX_KEY_BITS + MAX_FEATURE_BITS)) |
-                  (q - f.c_str()) << MAX_KEY_BITS |
-#endif
-                  c2i_[(p2f_[i] & 0xffffffff) + CP_MAX];
-      }
-      write_array(p2f_, p2f_fn);
-      // save pattern trie
-      for (std::vector<std::pair<std::string, uint64_t>>::const_iterator it =
-               keys.begin();
-           it != keys.end(); ++it) {
-        std::vector<int> key;
-        for (int offset(0), b(0); size_t(offset) < it->first.size();
-             offset += b)
-          key.push_back(c2i_[unicode(&it->first[offset], b)]);
-        if (it->second & 0xfff)
-          key.push_back(c2i_[(it->second & 0xfff) + CP_MAX]);
-        da.update(&key[0], key.size()) = it->second >> 12;
-      }
-      c2i_.resize(CP_MAX + 2);  // chop most of part-of-speech mapping
-      write_array(c2i_, c2i_fn);
-      da.save(da_fn.c_str());
+      py::print("building DA trie from patterns..");
+      model_compiler compiler;
+      compiler.compile(m);
+      compiler.save(m);
       py::print("Model conversion done.\n");
     }
     size_t buf_size{0};
@@ -968,220 +1131,331 @@ class tagger {
       py::print("da_fn not found:", da_fn);
       return false;
     }
-    //da.set_array(da_buf, buf_size / sizeof();
+    // refer to the mapped(or read) buffer; no private copy of the trie.
     da.set_array(da_buf, buf_size);
-    c2i = static_cast<const uint16_t *>(read_array(c2i_fn, 1, buf_size));
-    if (!c2i) {
+    const void *c2i_buf = read_array(c2i_fn, 1, buf_size);
+    if (!c2i_buf) {
       py::print("c2i_fn not found:", c2i_fn);
       return false;
     }
+    // build the compact paged mapping; the flat table(2.2MB) is not kept.
+    c2i.build(static_cast<const uint16_t *>(c2i_buf),
+              buf_size / sizeof(uint16_t));
+    release_array(1);
     p2f = static_cast<const uint64_t *>(read_array(p2f_fn, 2, buf_size));
     if (!p2f) {
       py::print("p2f_fn not found:", p2f_fn);
       return false;
     }
+    _num_features = buf_size / sizeof(uint64_t);
     fs = static_cast<const char *>(read_array(fs_fn, 3, buf_size));
     if (!fs) {
       py::print("fs_fn not found:", fs_fn);
       return false;
     }
+    // optional hot core(jagger-compile -H/-P); ignored if built for another
+    // trie.
+    if (FileExists(m + ".hot")) {
+      const void *hot = read_array(m + ".hot", 4, buf_size);
+      if (hot && !da.set_hot(hot, buf_size)) {
+        py::print("Ignore hot core built for another trie:", m + ".hot");
+        release_array(4);
+      }
+    }
+    // optional POS-context table(jagger-compile); without it, the trie is
+    // walked up to find the context.
+    if (FileExists(m + ".pos")) {
+      const void *pos = read_array(m + ".pos", 5, buf_size);
+      if (pos && !da.set_pos(pos, buf_size)) {
+        py::print("Ignore POS-context table built for another trie:",
+                  m + ".pos");
+        release_array(5);
+      }
+    }
     // py::print("All dict read OK");
 
     return true;
   }
-#if 0 // not used
-  template <const int BUF_SIZE_, const bool POS_TAGGING>
-  void run() const {
-    if (BUF_SIZE_ == 0) std::fprintf(stderr, "(input: stdin)\n");
-    char _res[BUF_SIZE], *_ptr(&_res[0]), *line(0);
-    simple_reader reader;
-    while (const size_t len = reader.gets(&line)) {
-      int bytes(0), bytes_prev(0), id(0), ctype(0), ctype_prev(0);
-      uint64_t offsets = c2i[CP_MAX + 1];
-      bool bos(true), ret(line[len - 1] == '\n'), concat(false);
-      for (const char *p(line), *const p_end(p + len - ret); p != p_end;
-           bytes_prev = bytes, ctype_prev = ctype,
-           offsets = p2f[static_cast<size_t>(id)], p += bytes) {
-        const int r = da.longestPrefixSearchWithPOS(p, p_end, offsets & 0x3fff,
-                                                    &c2i[0]);  // found word
-        id = r & 0xfffff;
-        bytes = (r >> 23) ? (r >> 23) : u8_len(p);
-        ctype = (r >> 20) & 0x7;  // 0: num|unk / 1: alpha / 2: kana / 3: other
-        if (!bos) {  // word that may concat with the future context
-          if (ctype_prev != ctype ||  // different character types
-              ctype_prev == 3 ||      // seen words in non-num/alpha/kana
-              (ctype_prev == 2 && bytes_prev + bytes >= 18)) {
-            if (POS_TAGGING) {
-#ifdef USE_COMPACT_DICT
-              write_string(_ptr, &fs[((offsets >> MAX_KEY_BITS) & 0xfffff)]);
-              if (concat)
-                write_string(_ptr, ",*,*,*\n", 7);
-              else
-                write_string(_ptr, &fs[(offsets >> 34)]);
-#else
-              if (concat) {
-                write_string(_ptr, &fs[(offsets >> 34)],
-                             (offsets >> MAX_KEY_BITS) & 0x7f);
-                write_string(_ptr, ",*,*,*\n", 7);
-              } else
-                write_string(
-                    _ptr, &fs[(offsets >> 34)],
-                    (offsets >> (MAX_KEY_BITS + MAX_FEATURE_BITS)) & 0x3ff);
-#endif
-              concat = false;
-            } else
-              write_string(_ptr, " ", 1);
-          } else
-            concat = true;
-        } else
-          bos = false;
-        write_string(_ptr, p, static_cast<size_t>(bytes));
+  // A word found by the trie search, before words of the same character type
+  // are concatenated into a token.
+  struct raw_token {
+    size_t k;          // index of the first character(char_ids)
+    int bytes;         // surface length
+    int r;             // result of the search(pattern ID, ctype, bytes)
+    uint16_t fi_prev;  // POS of the previous word used in the search
+  };
+
+  // Finds words from the k-th character of the decoded line until a word
+  // starts at or after the k_end-th one; fi_prev is the POS of the word
+  // before the k-th character.
+  void segment(const char_ids &chars, const size_t n, size_t k,
+               const size_t k_end, int fi_prev,
+               std::vector<raw_token> &out) const {
+    while (k < k_end) {
+      const int r = da.longestPrefixSearchWithPOS(&chars.id[k], fi_prev);
+      const int bytes = (r >> 23)
+                            ? (r >> 23)
+                            : static_cast<int>(chars.off[k + 1] - chars.off[k]);
+      out.push_back(raw_token{k, bytes, r, static_cast<uint16_t>(fi_prev)});
+      fi_prev = p2f[static_cast<size_t>(r & 0xfffff)] & 0x3fff;
+      k = chars.skip(k, static_cast<size_t>(bytes), n);
+    }
+  }
+
+  // Same as segment(), but takes the rest of the words from spec(found from
+  // a guessed state) once a word in spec starts at the same character after
+  // the same POS.
+  void resegment(const char_ids &chars, const size_t n, size_t k,
+                 const size_t k_end, int fi_prev,
+                 const std::vector<raw_token> &spec,
+                 std::vector<raw_token> &out) const {
+    size_t i = 0;
+    while (k < k_end) {
+      while (i < spec.size() && spec[i].k < k) i++;
+      if (i < spec.size() && spec[i].k == k && spec[i].fi_prev == fi_prev) {
+        out.insert(out.end(), spec.begin() + ptrdiff_t(i), spec.end());
+        return;
       }
-      if (!bos)  // output fs of last token
-        if (POS_TAGGING) {
-#ifdef USE_COMPACT_DICT
-          write_string(_ptr, &fs[((offsets >> MAX_KEY_BITS) & 0xfffff)]);
-          if (concat)
-            write_string(_ptr, ",*,*,*\n", 7);
-          else
-            write_string(_ptr, &fs[(offsets >> 34)]);
-#else
-          if (concat) {
-            write_string(_ptr, &fs[(offsets >> 34)],
-                         (offsets >> MAX_KEY_BITS) & 0x7f);
-            write_string(_ptr, ",*,*,*\n", 7);
-          } else
-            write_string(
-                _ptr, &fs[(offsets >> 34)],
-                (offsets >> (MAX_KEY_BITS + MAX_FEATURE_BITS)) & 0x3ff);
-#endif
-        }
-      write_string(_ptr, POS_TAGGING ? "EOS\n" : "\n", POS_TAGGING ? 4 : 1);
-      write_buffer(_ptr, &_res[0], BUF_SIZE_);
+      segment(chars, n, k, k + 1, fi_prev, out);  // one word
+      k = chars.skip(k, static_cast<size_t>(out.back().bytes), n);
+      fi_prev = p2f[static_cast<size_t>(out.back().r & 0xfffff)] & 0x3fff;
+    }
+  }
+
+  // Finds the words of a decoded line of n characters. When pool and
+  // piece_bytes are given, a long line is split into pieces(of piece_bytes or
+  // more) after "。", which are segmented in parallel. The words of a piece
+  // are found from a guessed state(the POS of "。"), and re-found from the
+  // true state at the end of the previous piece until they meet the guessed
+  // ones if it differs; the result is the same as the serial path.
+  void segment_line(const char *line, const char_ids &chars, const size_t n,
+                    ThreadPool *pool, const size_t piece_bytes,
+                    std::vector<std::vector<raw_token>> &words) const {
+    const int bos = c2i[CP_MAX + 1] & 0x3fff;
+    // cuts[j]: the first character of the j-th piece
+    std::vector<size_t> cuts(1, 0);
+    if (pool && pool->size() > 1 && piece_bytes > 0) {
+      static const char kPeriod[] = "\xe3\x80\x82";  // "。"
+      const char *const end = line + chars.off[n];
+      for (const char *p = line + piece_bytes; p < end;) {
+        p = std::search(p, end, kPeriod, kPeriod + 3);
+        if (p == end) break;
+        p += 3;
+        const size_t k = size_t(
+            std::lower_bound(chars.off.begin(), chars.off.begin() + ptrdiff_t(n),
+                             uint32_t(p - line)) -
+            chars.off.begin());
+        if (k >= n) break;
+        if (line + chars.off[k] != p) continue;  // not a character boundary
+        cuts.push_back(k);
+        p += piece_bytes;
+      }
+    }
+    cuts.push_back(n);
+    const size_t m = cuts.size() - 1;
+    words.resize(m);
+    if (m == 1) {
+      segment(chars, n, 0, n, bos, words[0]);
+      return;
+    }
+
+    std::vector<int> guess(m, bos);
+    pool->run(m, [&](size_t j) {
+      if (j) {  // POS of "。" found without the context
+        const int r = da.longestPrefixSearchWithPOS(&chars.id[cuts[j] - 1], 0);
+        guess[j] = p2f[static_cast<size_t>(r & 0xfffff)] & 0x3fff;
+      }
+      segment(chars, n, cuts[j], cuts[j + 1], guess[j], words[j]);
+    });
+    // verify the guessed states in order
+    const raw_token *last = &words[0].back();
+    for (size_t j = 1; j < m; j++) {
+      const size_t k = chars.skip(last->k, size_t(last->bytes), n);
+      const int fi_prev = p2f[static_cast<size_t>(last->r & 0xfffff)] & 0x3fff;
+      if (k != cuts[j] || fi_prev != guess[j]) {
+        std::vector<raw_token> fixed;
+        resegment(chars, n, k, cuts[j + 1], fi_prev, words[j], fixed);
+        words[j].swap(fixed);
+      }
+      if (!words[j].empty()) last = &words[j].back();
     }
-    write_buffer(_ptr, &_res[0], 0);
   }
-#endif
 
-  // Tokenize single line.
-  //
-  // TODO:
   //
-  // - [ ] Support compact dict
-  // - [ ] Optimize output(stringstream & constcut std::string are rather slow)
-  // - [x] Return structured output(PyToken)
+  // Tokenize single line into columns(no string is made); offsets are
+  // relative to line + base.
   //
-  // @return Unified output.
-  std::vector<PyToken> tokenize_line(const char *addr, const size_t len) const {
-#define BUF_SIZE_ (BUF_SIZE >> 1)
-#define POS_TAGGING 1
+  void tokenize_line(const char *line, const size_t len, const size_t base,
+                     token_columns &out, ThreadPool *pool = nullptr,
+                     const size_t piece_bytes = 0) const {
+    const bool ret = len > 0 && line[len - 1] == '\n';
+    char_ids chars;
+    const size_t n = chars.decode(line, line + len - ret, c2i);
+    column_writer sink{out, base};
+    if (!pool || piece_bytes == 0) {
+      tag_line(da, p2f, c2i, chars, n, sink);
+      return;
+    }
+    std::vector<std::vector<raw_token>> words;
+    segment_line(line, chars, n, pool, piece_bytes, words);
+    token_grouper<column_writer> tokens(sink);
+    for (size_t j = 0; j < words.size(); j++) {
+      for (const raw_token &t : words[j]) {
+        tokens.add(chars.off[t.k], t.bytes, t.r);
+      }
+    }
+    tokens.flush();
+  }
 
-    std::vector<PyToken> toks;
+  // # features(entries of p2f)
+  size_t num_features() const { return _num_features; }
+
+  // feature of ID(p2f index) in the model; only POS for concatenated words
+  const char *feature_data(const size_t id, const bool concat,
+                           size_t &n) const {
+    const uint64_t offsets = p2f[id];
+    const char *p = &fs[(offsets >> 34)];
+    n = concat ? (offsets >> MAX_KEY_BITS) & 0x7f
+               : (offsets >> (MAX_KEY_BITS + MAX_FEATURE_BITS)) & 0x3ff;
+    // feature contains leading '\t' and ending '\n'. we remove it.
+    while (n > 0 && is_space(*p)) p++, n--;
+    while (!concat && n > 0 && is_space(p[n - 1])) n--;
+    return p;
+  }
 
-    std::stringstream ss;
+  // feature of ID(p2f index); "POS,*,*,*" for concatenated words
+  std::string feature(const size_t id, const bool concat) const {
+    size_t n = 0;
+    const char *p = feature_data(id, concat, n);
+    std::string f;
+    f.reserve(n + 6);
+    f.assign(p, n);
+    if (concat) f += kConcatFields;
+    return f;
+  }
 
-    char _res[BUF_SIZE], *_ptr(&_res[0]);
-    const char *line = addr;
-    {
-      int bytes(0), bytes_prev(0), id(0), ctype(0), ctype_prev(0);
-      uint64_t offsets = c2i[CP_MAX + 1];
-      bool bos(true), ret(line[len - 1] == '\n'), concat(false);
-      for (const char *p(line), *const p_end(p + len - ret); p != p_end;
-           bytes_prev = bytes, ctype_prev = ctype,
-           offsets = p2f[static_cast<size_t>(id)], p += bytes) {
-        const int r = da.longestPrefixSearchWithPOS(p, p_end, offsets & 0x3fff,
-                                                    &c2i[0]);  // found word
-        id = r & 0xfffff;
-        bytes = (r >> 23) ? (r >> 23) : u8_len(p);
-        ctype = (r >> 20) & 0x7;  // 0: num|unk / 1: alpha / 2: kana / 3: other
-        if (!bos) {  // word that may concat with the future context
-          if (ctype_prev != ctype ||  // different character types
-              ctype_prev == 3 ||      // seen words in non-num/alpha/kana
-              (ctype_prev == 2 && bytes_prev + bytes >= 18)) {
-            if (POS_TAGGING) {
-              if (concat) {
-                write_string(_ptr, &fs[(offsets >> 34)],
-                             (offsets >> MAX_KEY_BITS) & 0x7f);
-                write_string(_ptr, ",*,*,*\n", 7);
-
-                toks.back().get_feature() = ltrim(std::string(&fs[(offsets >> 34)],
-                             (offsets >> MAX_KEY_BITS) & 0x7f));
-
-                toks.back().get_feature() += ",*,*,*";
-              } else {
-                write_string(
-                    _ptr, &fs[(offsets >> 34)],
-                    (offsets >> (MAX_KEY_BITS + MAX_FEATURE_BITS)) & 0x3ff);
-
-                // feature contains leading '\t' and ending '\n'. we remove it.
-                toks.back().get_feature() = ltrim(rtrim(std::string(&fs[(offsets >> 34)],
-                             (offsets >> (MAX_KEY_BITS + MAX_FEATURE_BITS)) & 0x3ff)));
-              }
-              concat = false;
-            } else {
-              write_string(_ptr, " ", 1);
-            }
-          } else {
-            concat = true;
-          }
-        } else {
-          bos = false;
-        }
+  // fields of feature(id, concat) split with the default quote char('"');
+  // safe to call from multiple threads
+  feature_fields fields(const size_t id, const bool concat) const {
+    std::call_once(_fields_once, [this] {
+      _fields.reset(new std::atomic<const uint16_t *>[2 * _num_features]());
+    });
+    std::atomic<const uint16_t *> &slot =
+        _fields[concat ? _num_features + id : id];
+    const uint16_t *ends = slot.load(std::memory_order_acquire);
+    if (!ends) {
+      const std::string f = feature(id, concat);
+      std::vector<uint32_t> e;
+      split_feature(f.data(), f.size(), e);
+      std::unique_ptr<uint16_t[]> block(new uint16_t[e.size() + 1]);
+      block[0] = uint16_t(e.size());
+      for (size_t i = 0; i < e.size(); i++) block[i + 1] = uint16_t(e[i]);
+      // another thread may have filled the slot
+      if (slot.compare_exchange_strong(ends, block.get(),
+                                       std::memory_order_acq_rel)) {
+        ends = block.release();
+      }
+    }
+    feature_fields r;
+    r.p = feature_data(id, concat, r.n);
+    r.ends = ends;
+    return r;
+  }
 
-        // surface
-        write_string(_ptr, p, static_cast<size_t>(bytes));
+ private:
+  // whitespace removed by ltrim/rtrim
+  static bool is_space(const char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' ||
+           c == '\v';
+  }
+};
 
-        if (concat) {
-          // concat word to the surface of last token
-          toks.back().get_surface() += std::string(p, static_cast<size_t>(bytes));
-        } else {
-          PyToken tok;
-          tok.get_surface() = std::string(p, static_cast<size_t>(bytes));
-          toks.push_back(tok);
-        }
-      }
-      if (!bos)  // output fs of last token
-        if (POS_TAGGING) {
-          if (concat) {
-            write_string(_ptr, &fs[(offsets >> 34)],
-                         (offsets >> MAX_KEY_BITS) & 0x7f);
-            write_string(_ptr, ",*,*,*\n", 7);
-
-            toks.back().get_feature() = ltrim(std::string(&fs[(offsets >> 34)],
-                         (offsets >> MAX_KEY_BITS) & 0x7f));
-
-            toks.back().get_feature() += ",*,*,*";
-          } else {
-            write_string(
-                _ptr, &fs[(offsets >> 34)],
-                (offsets >> (MAX_KEY_BITS + MAX_FEATURE_BITS)) & 0x3ff);
-            // feature contains leading '\t' and ending '\n'. we remove it.
-            toks.back().get_feature() = ltrim(rtrim(std::string(&fs[(offsets >> 34)],
-                         (offsets >> (MAX_KEY_BITS + MAX_FEATURE_BITS)) & 0x3ff)));
-          }
-        }
-      write_string(_ptr, POS_TAGGING ? "EOS\n" : "\n", POS_TAGGING ? 4 : 1);
-      // write_buffer(_ptr, &_res[0], BUF_SIZE_);
-      if (ptrdiff_t(_ptr - &_res[0]) <
-          ptrdiff_t(BUF_SIZE_)) {  // This should not happen though
-        ss << std::string(&_res[0], _ptr);
-      }
+// tokens of a batch in one place; surfaces are in text(a copy of the input)
+// and features in the model
+struct token_arena {
+  std::string text;
+  token_columns cols;          // offsets in text
+  std::vector<int64_t> lines;  // tokens of i-th line: [lines[i], lines[i + 1])
+  std::shared_ptr<const tagger> model;
+};
+
+//
+// Token(a view of a token in token_arena). Strings are made on access.
+//
+class PyToken {
+ public:
+  PyToken() = default;
+  PyToken(std::shared_ptr<const token_arena> arena, size_t index)
+      : _arena(std::move(arena)), _index(index) {}
+
+  std::string surface() const {
+    if (!_arena) {
+      return std::string();
+    }
+    const token_columns &cols = _arena->cols;
+    return _arena->text.substr(size_t(cols.begin[_index]),
+                               size_t(cols.end[_index] - cols.begin[_index]));
+  }
+
+  // comma separated feature
+  std::string feature() const {
+    if (!_arena) {
+      return std::string();
+    }
+    const uint32_t id = _arena->cols.feature[_index];
+    return _arena->model->feature(id & ~kConcatFeature,
+                                  (id & kConcatFeature) != 0);
+  }
+
+  void set_quote_char(const std::string &quote_char) {
+    _quote_char = quote_char;
+    _tags.clear();
+  }
+
+  uint32_t n_tags() const {
+    if (!_arena) {
+      return 0;
+    }
+    if (_quote_char == "\"") {
+      return uint32_t(fields().size());
+    }
+
+    // cache result.
+    if (_tags.empty()) {
+      const std::string f = feature();
+      _tags = parse_feature(f.data(), f.size(), ',', _quote_char.c_str());
     }
-    // write_buffer(_ptr, &_res[0], 0); // = fflush
-    return toks;
+
+    return uint32_t(_tags.size());
   }
-#undef BUF_SIZE_
-#undef POS_TAGGING
 
-  std::vector<PyToken> tokenize(const std::string &str) const {
-    std::vector<PyToken> toks;
-    if (str.empty()) {
-      return toks;
+  // TODO: use string_view
+  std::string tag(uint32_t idx) const {
+    if (_arena && _quote_char == "\"") {
+      const feature_fields f = fields();
+      return idx < f.size() ? f.at(idx) : std::string();
     }
+    if (idx < n_tags()) {
+      return _tags[idx];
+    }
+    return std::string();
+  }
 
-    toks = tokenize_line(&str[0], str.size());
+  const std::string str() const {
+    return surface() + "\t" + feature();
+  }
+
+ private:
+  std::shared_ptr<const token_arena> _arena;
+  size_t _index{0};
+  mutable std::vector<std::string> _tags;  // with a custom quote char
+  std::string _quote_char = "\"";
 
-    return toks;
+  // fields of the feature ID, split once per model
+  feature_fields fields() const {
+    const uint32_t id = _arena->cols.feature[_index];
+    return _arena->model->fields(id & ~kConcatFeature,
+                                 (id & kConcatFeature) != 0);
   }
 };
 
@@ -1190,23 +1464,163 @@ class tagger {
 
 namespace pyjagger {
 
+// 1-D array exposed with the buffer protocol(numpy.asarray(), memoryview())
+template <typename T>
+class Column {
+ public:
+  std::vector<T> data;
+};
+
+///
+/// Result of tokenize_batch_arrays. Tokens of the i-th line are
+/// [lines[i], lines[i + 1]); begin/end of a token are byte offsets in the
+/// UTF-8 input and feature is its ID(see PyJagger::feature_table).
+///
+struct TokenArrays {
+  Column<int64_t> begin;
+  Column<int64_t> end;
+  Column<uint32_t> feature;
+  Column<int64_t> lines;
+};
+
+// index of a sequence of n items(negative: from the end)
+inline size_t item_index(int64_t i, size_t n) {
+  if (i < 0) i += int64_t(n);
+  if (i < 0 || size_t(i) >= n) throw py::index_error();
+  return size_t(i);
+}
+
+// list of items of a sequence of n items in a slice(as list slicing does)
+template <typename F>
+py::list slice_items(const py::slice &slice, size_t n, F item) {
+  size_t start = 0, stop = 0, step = 0, length = 0;
+  if (!slice.compute(n, &start, &stop, &step, &length)) {
+    throw py::error_already_set();
+  }
+  py::list items;
+  for (size_t i = 0; i < length; i++, start += step) {  // step may wrap
+    items.append(py::cast(item(start)));
+  }
+  return items;
+}
+
+///
+/// Tokens of a line in TokenBatch. Token objects are created on access.
+///
+class TokenLine {
+ public:
+  TokenLine(std::shared_ptr<const jagger::token_arena> arena, size_t line)
+      : _arena(std::move(arena)), _line(line) {}
+
+  size_t size() const {
+    return size_t(_arena->lines[_line + 1] - _arena->lines[_line]);
+  }
+
+  jagger::PyToken at(int64_t i) const {
+    return jagger::PyToken(
+        _arena, size_t(_arena->lines[_line]) + item_index(i, size()));
+  }
+
+  py::list at(const py::slice &slice) const {
+    return slice_items(slice, size(), [this](size_t i) { return token(i); });
+  }
+
+  // list of Token
+  py::list to_list() const {
+    py::list tokens;
+    for (size_t i = 0; i < size(); i++) {
+      tokens.append(py::cast(token(i)));
+    }
+    return tokens;
+  }
+
+  // same as repr() of the list of tokens
+  std::string repr() const {
+    std::string s = "[";
+    for (size_t i = 0; i < size(); i++) {
+      if (i > 0) s += ", ";
+      s += token(i).str();
+    }
+    return s + "]";
+  }
+
+ private:
+  jagger::PyToken token(size_t i) const {
+    return jagger::PyToken(_arena, size_t(_arena->lines[_line]) + i);
+  }
+
+  std::shared_ptr<const jagger::token_arena> _arena;
+  size_t _line;
+};
+
+///
+/// Result of tokenize_batch; a sequence of the tokens of each line(TokenLine).
+/// Tokens are stored in one arena and Token objects are created on access.
+///
+class TokenBatch {
+ public:
+  TokenBatch() : _arena(empty()) {}
+  explicit TokenBatch(std::shared_ptr<const jagger::token_arena> arena)
+      : _arena(std::move(arena)) {}
+
+  size_t size() const { return _arena->lines.size() - 1; }
+
+  TokenLine at(int64_t i) const { return TokenLine(_arena, item_index(i, size())); }
+
+  py::list at(const py::slice &slice) const {
+    return slice_items(slice, size(),
+                       [this](size_t i) { return TokenLine(_arena, i); });
+  }
+
+  // list of lists of Token; what tokenize_batch returned before
+  py::list to_list() const {
+    py::list lines;
+    for (size_t i = 0; i < size(); i++) {
+      lines.append(TokenLine(_arena, i).to_list());
+    }
+    return lines;
+  }
+
+  // same as repr() of to_list()
+  std::string repr() const {
+    std::string s = "[";
+    for (size_t i = 0; i < size(); i++) {
+      if (i > 0) s += ", ";
+      s += TokenLine(_arena, i).repr();
+    }
+    return s + "]";
+  }
+
+ private:
+  static std::shared_ptr<const jagger::token_arena> empty() {
+    std::shared_ptr<jagger::token_arena> arena =
+        std::make_shared<jagger::token_arena>();
+    arena->lines.push_back(0);
+    return arena;
+  }
+
+  std::shared_ptr<const jagger::token_arena> _arena;
+};
+
 class PyJagger {
  public:
-  PyJagger() : _tagger(new jagger::tagger()), _model_loaded{false} {}
+  PyJagger() : _tagger(std::make_shared<jagger::tagger>()), _model_loaded{false} {}
   PyJagger(const std::string &model_path)
-      : _model_path(model_path), _tagger(new jagger::tagger()) {
+      : _model_path(model_path), _tagger(std::make_shared<jagger::tagger>()) {
     load_model(_model_path);
   }
 
-  bool load_model(const std::string &model_path) {
-    if (_model_loaded) {
-      // discard previous model&instance.
-      delete _tagger;
-
-      _tagger = new jagger::tagger();
-    }
+  ///
+  /// @param[in] strict Do not compile `model_path` patterns when the model is
+  /// not compiled yet(use `jagger-compile` in advance).
+  ///
+  /// The previous model is released when the calls using it(in other
+  /// threads) return.
+  ///
+  bool load_model(const std::string &model_path, bool strict = false) {
+    std::shared_ptr<jagger::tagger> tagger = std::make_shared<jagger::tagger>();
 
-    if (_tagger->read_model(model_path)) {
+    if (tagger->read_model(model_path, strict)) {
       _model_loaded = true;
       _model_path = model_path;
       //py::print("Model loaded:", model_path);
@@ -1214,14 +1628,25 @@ class PyJagger {
       _model_loaded = false;
       py::print("Model load failed:", model_path);
     }
+    _tagger = std::move(tagger);
 
     return _model_loaded;
   }
 
   void set_threads(uint32_t nthreads) {
     _nthreads = nthreads;
+    if (_pool && _pool->size() != num_threads()) {
+      _pool.reset();  // recreated by the next call; joined when not in use
+    }
   }
 
+  ///
+  /// Lines of `nbytes` or longer are split into pieces(after "。") and tagged
+  /// with the worker threads(see set_threads). The result does not change.
+  /// 0 disables it.
+  ///
+  void set_split_threshold(size_t nbytes) { _split_threshold = nbytes; }
+
   ///
   /// Tokenize single-line string(char pointer version).
   ///
@@ -1230,116 +1655,612 @@ class PyJagger {
   ///
   /// Tokenize single-line string(std::string version).
   ///
-  std::vector<jagger::PyToken> tokenize(const std::string &src) const;
+  std::vector<jagger::PyToken> tokenize(std::string src) const;
 
   ///
   /// Tokenize string which is composed of multiple lines(delimited by '\n') in
-  /// batch. Uses C++11 threads when the number of lines > 1024.
+  /// batch, using the worker threads of this instance(see set_threads).
+  ///
+  /// @param[in] src UTF-8 string which is composed of multiple lines(char
+  /// pointer version; called with the GIL). It is copied once into the
+  /// result, which the surfaces of tokens refer to.
+  ///
+  TokenBatch tokenize_batch(const char *src, size_t size) const;
+
   ///
-  /// @param[in] src string which is composed of multiple lines.
-  /// @param[in] threads Optional. Control the number of C++11 threads(CPU
-  /// cores) to use.
+  /// str version; reads the UTF-8 buffer of str(no intermediate string).
   ///
-  std::vector<std::vector<jagger::PyToken>> tokenize_batch(const std::string &src) const;
+  TokenBatch tokenize_batch(const py::str &src) const;
+
+  ///
+  /// bytes, memoryview, mmap, etc. version(UTF-8; no intermediate string).
+  ///
+  TokenBatch tokenize_batch(const py::buffer &src) const;
+
+  ///
+  /// List of lines(str or bytes) version; returns tokens of each item. An
+  /// item is not split(a trailing '\n' or '\r\n' is ignored). Items are not
+  /// joined; each is copied once into the result.
+  ///
+  TokenBatch tokenize_batch(const py::list &src) const;
+
+  ///
+  /// Tokenize a UTF-8 text file(gzip-compressed one is decompressed when
+  /// built with zlib) as tokenize_batch. The file is read and decompressed in
+  /// blocks of lines on another thread while the blocks already read are
+  /// tagged. Raises OSError if the file cannot be read or decompressed, and
+  /// ValueError if it is not UTF-8.
+  ///
+  TokenBatch tokenize_file(const std::string &filename) const;
+
+  ///
+  /// Same as tokenize_batch, but returns tokens in flat arrays without
+  /// creating token objects.
+  ///
+  TokenArrays tokenize_batch_arrays(const char *src, size_t size) const;
+  TokenArrays tokenize_batch_arrays(const py::str &src) const;
+  TokenArrays tokenize_batch_arrays(const py::buffer &src) const;
+
+  ///
+  /// Features of the loaded model indexed by feature ID. The feature of a
+  /// token whose ID has kConcatFeature(bit 31) set is
+  /// `feature_table(true)[id & 0x7fffffff]`.
+  ///
+  std::vector<std::string> feature_table(bool concat = false) const;
 
  private:
+  uint32_t num_threads() const {
+    const uint32_t n = (_nthreads == 0)
+                           ? uint32_t(std::thread::hardware_concurrency())
+                           : _nthreads;
+    return (std::max)(1u, (std::min)(n, kMaxThreads));
+  }
+
+  // Worker threads for the batch APIs; created on the first call(with the
+  // GIL). Each call holds a reference, as with _tagger.
+  std::shared_ptr<ThreadPool> pool() const {
+#if !defined(_WIN32)
+    if (_pool && _pool_pid != getpid()) {
+      // forked; the pool cannot be destroyed here(see forked_pools).
+      forked_pools().push_back(std::move(_pool));
+    }
+#endif
+    if (!_pool) {
+      _pool = std::make_shared<ThreadPool>(num_threads());
+#if !defined(_WIN32)
+      _pool_pid = getpid();
+#endif
+    }
+    return _pool;
+  }
+
+  // the loaded model, or nullptr(with the GIL)
+  std::shared_ptr<jagger::tagger> loaded_tagger() const {
+    if (!_model_loaded) {
+      py::print("Model is not loaded.");
+      return nullptr;
+    }
+
+    if (!_tagger) {
+      py::print("PyJagger: ??? tagger instance is nullptr.");
+    }
+    return _tagger;
+  }
+
+  // UTF-8 buffer of str(cached in str; no copy for ASCII)
+  static const char *utf8(const py::str &s, size_t &size) {
+    Py_ssize_t n = 0;
+    const char *data = PyUnicode_AsUTF8AndSize(s.ptr(), &n);
+    if (!data) throw py::error_already_set();
+    size = size_t(n);
+    return data;
+  }
+
+  // throws ValueError unless data is valid UTF-8(with the GIL)
+  static void check_utf8(const char *data, size_t size,
+                         const std::string &what = std::string()) {
+    const size_t pos = find_invalid_utf8(data, size);
+    if (pos != size) {
+      throw py::value_error("invalid UTF-8" + what + " at byte offset " +
+                            std::to_string(pos));
+    }
+  }
+
+  // bytes of a buffer object; released when the returned info is destroyed
+  static py::buffer_info request_bytes(const py::buffer &b) {
+    py::buffer_info info = b.request();
+    if (info.ndim != 1 || info.strides[0] != info.itemsize) {
+      throw py::value_error("contiguous 1-D buffer is required");
+    }
+    return info;
+  }
+
+  //
+  // Tags lines in text with the worker threads into cols(offsets in text);
+  // tokens of the k-th line are [line_tokens[k], line_tokens[k + 1]). Lines
+  // are in order in text, so the positions balance the load by bytes. Called
+  // without the GIL.
+  //
+  void tag_lines(const jagger::tagger &tagger, ThreadPool &pool,
+                 const char *text, const std::vector<LineInfo> &lines,
+                 jagger::token_columns &cols,
+                 std::vector<int64_t> &line_tokens) const;
+
+  // bytes of a piece of a long line
+  size_t piece_bytes(size_t len, const ThreadPool &pool) const {
+    return (std::max)(kMinPieceBytes, len / (size_t(pool.size()) * 4));
+  }
+
   uint32_t _nthreads{0};  // 0 = use all cores
+  size_t _split_threshold{kSplitThreshold};
+  mutable std::shared_ptr<ThreadPool> _pool;
+#if !defined(_WIN32)
+  mutable pid_t _pool_pid{0};
+#endif
   std::string _model_path;
-  jagger::tagger *_tagger{nullptr};
+  // Read-only once loaded, so it is shared by the threads calling tokenize*
+  // without the GIL. Each call holds a reference taken with the GIL, so
+  // load_model() in another thread does not free it while in use.
+  std::shared_ptr<jagger::tagger> _tagger;
   bool _model_loaded{false};
 };
 
-std::vector<jagger::PyToken> PyJagger::tokenize(const std::string &src) const {
+std::vector<jagger::PyToken> PyJagger::tokenize(std::string src) const {
   std::vector<jagger::PyToken> dst;
-  if (!_model_loaded) {
-    py::print("Model is not loaded.");
+  const std::shared_ptr<jagger::tagger> tagger = loaded_tagger();
+  if (!tagger || src.empty()) {
     return dst;
   }
+  check_utf8(src.data(), src.size());  // bytes are accepted as well
 
-  if (!_tagger) {
-    py::print("PyJagger: ??? tagger instance is nullptr.");
-    return dst;
+  const bool split = _split_threshold > 0 && src.size() >= _split_threshold;
+  const std::shared_ptr<ThreadPool> pool = split ? this->pool() : nullptr;
+  std::shared_ptr<jagger::token_arena> arena =
+      std::make_shared<jagger::token_arena>();
+  {
+    // tagging does not touch Python objects; result objects are built by
+    // pybind11 after return(with the GIL).
+    py::gil_scoped_release release;
+    arena->text.swap(src);
+    arena->model = tagger;
+    tagger->tokenize_line(
+        arena->text.data(), arena->text.size(), 0, arena->cols, pool.get(),
+        pool ? piece_bytes(arena->text.size(), *pool) : 0);
+    arena->lines.push_back(0);
+    arena->lines.push_back(int64_t(arena->cols.size()));
+    dst.reserve(arena->cols.size());
+    for (size_t i = 0; i < arena->cols.size(); i++) {
+      dst.emplace_back(arena, i);
+    }
   }
 
-  dst = _tagger->tokenize(src);
-
   return dst;
 }
 
-std::vector<std::vector<jagger::PyToken>> PyJagger::tokenize_batch(const std::string &src) const {
-
-
-  std::vector<std::vector<jagger::PyToken>> dst;
+void PyJagger::tag_lines(const jagger::tagger &tagger, ThreadPool &pool,
+                         const char *text, const std::vector<LineInfo> &lines,
+                         jagger::token_columns &cols,
+                         std::vector<int64_t> &line_tokens) const {
+  const size_t num_lines = lines.size();
+  // tokens of lines [begin, end) in order; long lines are tagged as separate
+  // parts
+  struct Part {
+    size_t begin;
+    size_t end;
+    bool long_line;
+    jagger::token_columns cols;
+  };
+  std::vector<Part> parts;
+  std::mutex parts_mutex;
+  // # tokens of each line, then their positions in cols
+  std::vector<int64_t> &pos = line_tokens;
+  pos.assign(num_lines + 1, 0);
+
+  // bytes before the line(+ per-line overhead)
+  const size_t size = num_lines ? lines.back().pos + lines.back().len : 0;
+  auto cost = [&](size_t k) {
+    return (k < num_lines ? lines[k].pos : size) + k * kLineCost;
+  };
+  const size_t min_cost = (std::min)(
+      kMinChunkCost, cost(num_lines) / (size_t(pool.size()) * 8) + 1);
+  const size_t split = _split_threshold > 0
+                           ? _split_threshold
+                           : (std::numeric_limits<size_t>::max)();
+  pool.parallel_for(num_lines, cost, min_cost, [&](size_t begin, size_t end) {
+    Part part{begin, end, false, jagger::token_columns()};
+    for (size_t k = begin; k < end; k++) {
+      if (lines[k].len >= split) continue;  // below
+      const size_t n = part.cols.size();
+      tagger.tokenize_line(text + lines[k].pos, lines[k].len, lines[k].pos,
+                           part.cols);
+      pos[k + 1] = int64_t(part.cols.size() - n);
+    }
+    std::lock_guard<std::mutex> lock(parts_mutex);
+    parts.push_back(std::move(part));
+  });
+  // long lines; each is tagged with all the threads
+  for (size_t k = 0; k < num_lines; k++) {
+    if (lines[k].len < split) continue;
+    Part part{k, k + 1, true, jagger::token_columns()};
+    tagger.tokenize_line(text + lines[k].pos, lines[k].len, lines[k].pos,
+                         part.cols, &pool, piece_bytes(lines[k].len, pool));
+    pos[k + 1] = int64_t(part.cols.size());
+    parts.push_back(std::move(part));
+  }
+  for (size_t k = 0; k < num_lines; k++) pos[k + 1] += pos[k];
 
-  if (!_tagger) {
-    py::print("PyJagger: ??? tagger instance is nullptr.");
-    return dst;
+  const size_t num_tokens = size_t(pos[num_lines]);
+  if (parts.size() == 1) {  // in place
+    cols = std::move(parts[0].cols);
+    return;
   }
+  cols.begin.resize(num_tokens);
+  cols.end.resize(num_tokens);
+  cols.feature.resize(num_tokens);
+  pool.run(parts.size(), [&](size_t i) {
+    const Part &part = parts[i];
+    for (size_t k = part.begin, j = 0; k < part.end; k++) {
+      if (!part.long_line && lines[k].len >= split) continue;  // another part
+      const size_t n = size_t(pos[k + 1] - pos[k]);
+      std::copy_n(&part.cols.begin[j], n, &cols.begin[size_t(pos[k])]);
+      std::copy_n(&part.cols.end[j], n, &cols.end[size_t(pos[k])]);
+      std::copy_n(&part.cols.feature[j], n, &cols.feature[size_t(pos[k])]);
+      j += n;
+    }
+  });
+}
 
-  if (src.empty()) {
-    return dst;
+TokenBatch PyJagger::tokenize_batch(const char *src, size_t size) const {
+  const std::shared_ptr<jagger::tagger> tagger = loaded_tagger();
+  if (!tagger || size == 0) {
+    return TokenBatch();
   }
 
-  uint32_t num_threads = (_nthreads == 0)
-                             ? uint32_t(std::thread::hardware_concurrency())
-                             : _nthreads;
-  num_threads = (std::max)(
-      1u, (std::min)(static_cast<uint32_t>(num_threads), kMaxThreads));
+  const std::shared_ptr<ThreadPool> pool = this->pool();
 
+  // No Python API(incl. py::print) below until return.
+  py::gil_scoped_release release;
 
-  // result = [thread][lines]
-  LineInfoVector line_infos = split_lines(src, num_threads);
+  // surfaces of tokens refer to the copy
+  std::shared_ptr<jagger::token_arena> arena =
+      std::make_shared<jagger::token_arena>();
+  arena->text.assign(src, size);
+  arena->model = tagger;
+  const std::vector<LineInfo> lines =
+      split_lines(arena->text.data(), size, *pool);
+  tag_lines(*tagger, *pool, arena->text.data(), lines, arena->cols,
+            arena->lines);
 
-  // concat LineInfos
-  std::vector<LineInfo> lines;
-  for (size_t i = 0; i < line_infos->size(); i++) {
-    lines.insert(lines.end(), line_infos[i].begin(), line_infos[i].end());
-  }
+  return TokenBatch(std::move(arena));
+}
 
-  size_t num_lines = lines.size();
+TokenBatch PyJagger::tokenize_batch(const py::str &src) const {
+  size_t size = 0;
+  const char *data = utf8(src, size);
+  return tokenize_batch(data, size);
+}
 
-  dst.resize(num_lines);
+TokenBatch PyJagger::tokenize_batch(const py::buffer &src) const {
+  const py::buffer_info info = request_bytes(src);
+  check_utf8(static_cast<const char *>(info.ptr),
+             size_t(info.size * info.itemsize));
+  return tokenize_batch(static_cast<const char *>(info.ptr),
+                        size_t(info.size * info.itemsize));
+}
 
-  std::vector<std::thread> workers;
-  std::atomic<size_t> count{0};
-  const char *addr = src.data();
+TokenBatch PyJagger::tokenize_batch(const py::list &src) const {
+  const std::shared_ptr<jagger::tagger> tagger = loaded_tagger();
+  if (!tagger) {
+    return TokenBatch();
+  }
 
-  for (uint32_t t = 0; t < num_threads; t++) {
-    workers.emplace_back(std::thread([&]() {
+  // the items are referenced while tagging without the GIL, in case the list
+  // is modified by another thread.
+  const size_t num_lines = src.size();
+  std::vector<py::object> items(num_lines);
+  std::vector<LineRef> refs(num_lines);
+  for (size_t k = 0; k < num_lines; k++) {
+    items[k] = src[k];
+    if (py::isinstance<py::bytes>(items[k])) {
+      char *data = nullptr;
+      Py_ssize_t size = 0;
+      PyBytes_AsStringAndSize(items[k].ptr(), &data, &size);
+      refs[k] = LineRef{data, size_t(size)};
+      check_utf8(data, size_t(size), " in item " + std::to_string(k));
+    } else if (py::isinstance<py::str>(items[k])) {
+      refs[k].ptr = utf8(py::reinterpret_borrow<py::str>(items[k]), refs[k].len);
+    } else {
+      throw py::type_error("tokenize_batch: list of str or bytes is required");
+    }
+    // trailing newline
+    const char *p = refs[k].ptr;
+    size_t &len = refs[k].len;
+    if (len > 0 && p[len - 1] == '\n') len--;
+    if (len > 0 && p[len - 1] == '\r') len--;
+  }
 
-      size_t k = 0;
-      while ((k = count++) < num_lines) {
+  const std::shared_ptr<ThreadPool> pool = this->pool();
+
+  // No Python API(incl. py::print) below until return.
+  py::gil_scoped_release release;
+
+  // the items are copied to one buffer, which surfaces of tokens refer to
+  std::shared_ptr<jagger::token_arena> arena =
+      std::make_shared<jagger::token_arena>();
+  std::vector<LineInfo> lines(num_lines);
+  size_t size = 0;
+  for (size_t k = 0; k < num_lines; k++) size += refs[k].len;
+  arena->text.reserve(size);
+  for (size_t k = 0; k < num_lines; k++) {
+    lines[k].pos = arena->text.size();
+    lines[k].len = refs[k].len;
+    arena->text.append(refs[k].ptr, refs[k].len);
+  }
+  arena->model = tagger;
+  tag_lines(*tagger, *pool, arena->text.data(), lines, arena->cols,
+            arena->lines);
 
-        std::vector<jagger::PyToken> toks;
-        toks = _tagger->tokenize_line(addr + lines[k].pos, lines[k].len);
+  return TokenBatch(std::move(arena));
+}
 
-        dst[k] = std::move(toks);
+TokenBatch PyJagger::tokenize_file(const std::string &filename) const {
+  const std::shared_ptr<jagger::tagger> tagger = loaded_tagger();
+  if (!tagger) {
+    return TokenBatch();
+  }
+
+#ifdef _WIN32
+  const int fd = _wopen(UTF8ToWchar(filename).c_str(), _O_RDONLY | _O_BINARY);
+#else
+  const int fd = ::open(filename.c_str(), O_RDONLY);
+#endif
+  if (fd == -1) {
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename.c_str());
+    throw py::error_already_set();
+  }
+
+  const std::shared_ptr<ThreadPool> pool = this->pool();
 
+  std::shared_ptr<jagger::token_arena> arena =
+      std::make_shared<jagger::token_arena>();
+  arena->model = tagger;
+  arena->lines.push_back(0);
+  const char *error = nullptr;  // of reading; set by the reader thread
+  int read_errno = 0;           // errno of a failed read(0: gzip error)
+  std::string invalid;          // the file is not UTF-8
+  {
+    // No Python API(incl. py::print) in this scope.
+    py::gil_scoped_release release;
+
+    // blocks of lines read on the reader thread; a block ends after '\n'
+    // (or at EOF), so no line(incl. "\r\n") spans blocks.
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::string> blocks;
+    bool done = false;
+    bool stop = false;  // set when the tagging side returns early
+
+    std::thread reader([&]() {
+      input_stream in(fd);
+      std::string rest;  // a partial line carried over to the next block
+      for (bool eof = false; !eof;) {
+        std::string block;
+        block.swap(rest);
+        size_t size = block.size();
+        block.resize((std::max)(kFileBlockBytes, size * 2));
+        while (size < block.size()) {
+          errno = 0;
+          const long r = in.read(&block[size], block.size() - size);
+          if (r <= 0) {
+            if (r < 0) read_errno = errno;
+            eof = true;
+            break;
+          }
+          size += size_t(r);
+        }
+        size_t end = size;
+        if (!eof) {  // cut after the last '\n'; a long line grows the block
+          const size_t nl = block.rfind('\n', size - 1);
+          end = (nl == std::string::npos) ? 0 : nl + 1;
+        }
+        rest.assign(block, end, size - end);
+        block.resize(end);
+        if (block.empty()) continue;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return stop || blocks.size() < kFileBlocks; });
+        if (stop) break;
+        blocks.push_back(std::move(block));
+        cv.notify_all();
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      error = in.error();
+      done = true;
+      cv.notify_all();
+    });
+
+    for (;;) {
+      std::string block;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return done || !blocks.empty(); });
+        if (blocks.empty() || error) break;
+        block.swap(blocks.front());
+        blocks.pop_front();
+        cv.notify_all();
+      }
+      const size_t pos = find_invalid_utf8(block.data(), block.size());
+      if (pos != block.size()) {
+        invalid = "invalid UTF-8 at byte offset " +
+                  std::to_string(arena->text.size() + pos);
+        break;
       }
-    }));
+      const std::vector<LineInfo> lines =
+          split_lines(block.data(), block.size(), *pool);
+      jagger::token_columns cols;
+      std::vector<int64_t> line_tokens;
+      tag_lines(*tagger, *pool, block.data(), lines, cols, line_tokens);
+
+      // offsets in the block to those in the arena
+      const int64_t base = int64_t(arena->text.size());
+      const int64_t num_tokens = int64_t(arena->cols.size());
+      arena->text.append(block);
+      for (size_t i = 0; i < cols.size(); i++) {
+        arena->cols.begin.push_back(cols.begin[i] + base);
+        arena->cols.end.push_back(cols.end[i] + base);
+      }
+      arena->cols.feature.insert(arena->cols.feature.end(),
+                                 cols.feature.begin(), cols.feature.end());
+      for (size_t k = 1; k < line_tokens.size(); k++) {
+        arena->lines.push_back(line_tokens[k] + num_tokens);
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+      cv.notify_all();
+    }
+    reader.join();
+  }
+  ::close(fd);
+
+  // OSError as Python file APIs raise(incl. gzip.BadGzipFile)
+  if (error && read_errno) {
+    errno = read_errno;
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename.c_str());
+    throw py::error_already_set();
+  } else if (error) {
+    PyErr_SetString(PyExc_OSError, (filename + ": " + error).c_str());
+    throw py::error_already_set();
+  } else if (!invalid.empty()) {
+    throw py::value_error(filename + ": " + invalid);
   }
+  return TokenBatch(std::move(arena));
+}
 
-  for (auto &worker : workers) {
-    worker.join();
+TokenArrays PyJagger::tokenize_batch_arrays(const char *src, size_t size) const {
+  TokenArrays dst;
+  dst.lines.data.push_back(0);
+
+  const std::shared_ptr<jagger::tagger> tagger = loaded_tagger();
+  if (!tagger || size == 0) {
+    return dst;
   }
 
+  const std::shared_ptr<ThreadPool> pool = this->pool();
+
+  // No Python API(incl. py::print) below until return.
+  py::gil_scoped_release release;
+
+  const std::vector<LineInfo> lines = split_lines(src, size, *pool);
+  jagger::token_columns cols;
+  tag_lines(*tagger, *pool, src, lines, cols, dst.lines.data);
+  dst.begin.data.swap(cols.begin);
+  dst.end.data.swap(cols.end);
+  dst.feature.data.swap(cols.feature);
+
   return dst;
 }
 
+TokenArrays PyJagger::tokenize_batch_arrays(const py::str &src) const {
+  size_t size = 0;
+  const char *data = utf8(src, size);
+  return tokenize_batch_arrays(data, size);
+}
+
+TokenArrays PyJagger::tokenize_batch_arrays(const py::buffer &src) const {
+  const py::buffer_info info = request_bytes(src);
+  check_utf8(static_cast<const char *>(info.ptr),
+             size_t(info.size * info.itemsize));
+  return tokenize_batch_arrays(static_cast<const char *>(info.ptr),
+                               size_t(info.size * info.itemsize));
+}
+
+std::vector<std::string> PyJagger::feature_table(bool concat) const {
+  std::vector<std::string> table;
+  const std::shared_ptr<jagger::tagger> tagger = loaded_tagger();
+  if (!tagger) {
+    return table;
+  }
+  table.resize(tagger->num_features());
+  for (size_t i = 0; i < table.size(); i++) {
+    table[i] = tagger->feature(i, concat);
+  }
+  return table;
+}
+
 }  // namespace pyjagger
 
+namespace {
+
+template <typename T>
+void bind_column(py::module_ &m, const char *name) {
+  py::class_<pyjagger::Column<T>>(m, name, py::buffer_protocol())
+      .def_buffer([](pyjagger::Column<T> &c) -> py::buffer_info {
+        static T empty;  // a buffer must not be null
+        return py::buffer_info(c.data.empty() ? &empty : c.data.data(),
+                               sizeof(T), py::format_descriptor<T>::format(),
+                               1, {static_cast<py::ssize_t>(c.data.size())},
+                               {static_cast<py::ssize_t>(sizeof(T))},
+                               /* readonly */ true);
+      })
+      .def("__len__", [](const pyjagger::Column<T> &c) { return c.data.size(); })
+      .def("__getitem__", [](const pyjagger::Column<T> &c, size_t i) {
+        if (i >= c.data.size()) throw py::index_error();
+        return c.data[i];
+      });
+}
+
+}  // namespace
+
 PYBIND11_MODULE(jagger_ext, m) {
   m.doc() = "Python binding for Jagger.";
 
   // Add Ext prefix to avoid name conflict of 'Jagger' class in Python
   // world(defined in `jagger/__init__.py`)
+  using pyjagger::PyJagger;
+  using pyjagger::TokenBatch;
+
   py::class_<pyjagger::PyJagger>(m, "JaggerExt")
       .def(py::init<>())
       .def(py::init<std::string>())
-      .def("load_model", &pyjagger::PyJagger::load_model)
+      .def("load_model", &pyjagger::PyJagger::load_model,
+           py::arg("model_path"), py::arg("strict") = false)
       .def("tokenize", &pyjagger::PyJagger::tokenize)
-      .def("tokenize_batch", &pyjagger::PyJagger::tokenize_batch)
-      .def("set_threads", &pyjagger::PyJagger::set_threads);
+      // list and buffer objects first; py::str converts other objects
+      .def("tokenize_batch", static_cast<TokenBatch (PyJagger::*)(const py::list &) const>(&PyJagger::tokenize_batch))
+      .def("tokenize_batch", static_cast<TokenBatch (PyJagger::*)(const py::buffer &) const>(&PyJagger::tokenize_batch))
+      .def("tokenize_batch", static_cast<TokenBatch (PyJagger::*)(const py::str &) const>(&PyJagger::tokenize_batch))
+      .def("tokenize_file", &PyJagger::tokenize_file)
+      .def("set_threads", &pyjagger::PyJagger::set_threads)
+      .def("set_split_threshold", &pyjagger::PyJagger::set_split_threshold)
+      .def("tokenize_batch_arrays", static_cast<pyjagger::TokenArrays (PyJagger::*)(const py::buffer &) const>(&PyJagger::tokenize_batch_arrays))
+      .def("tokenize_batch_arrays", static_cast<pyjagger::TokenArrays (PyJagger::*)(const py::str &) const>(&PyJagger::tokenize_batch_arrays))
+      .def("feature_table", &pyjagger::PyJagger::feature_table,
+           py::arg("concat") = false);
+
+  bind_column<int64_t>(m, "Int64Array");
+  bind_column<uint32_t>(m, "UInt32Array");
+
+  py::class_<pyjagger::TokenArrays>(m, "TokenArrays")
+      .def_readonly("begin", &pyjagger::TokenArrays::begin)
+      .def_readonly("end", &pyjagger::TokenArrays::end)
+      .def_readonly("feature", &pyjagger::TokenArrays::feature)
+      .def_readonly("lines", &pyjagger::TokenArrays::lines);
+
+  py::class_<pyjagger::TokenBatch>(m, "TokenBatch")
+      .def("__len__", &pyjagger::TokenBatch::size)
+      .def("__getitem__", static_cast<pyjagger::TokenLine (pyjagger::TokenBatch::*)(int64_t) const>(&pyjagger::TokenBatch::at))
+      .def("__getitem__", static_cast<py::list (pyjagger::TokenBatch::*)(const py::slice &) const>(&pyjagger::TokenBatch::at))
+      .def("to_list", &pyjagger::TokenBatch::to_list)
+      .def("__repr__", &pyjagger::TokenBatch::repr);
+
+  py::class_<pyjagger::TokenLine>(m, "TokenLine")
+      .def("__len__", &pyjagger::TokenLine::size)
+      .def("__getitem__", static_cast<jagger::PyToken (pyjagger::TokenLine::*)(int64_t) const>(&pyjagger::TokenLine::at))
+      .def("__getitem__", static_cast<py::list (pyjagger::TokenLine::*)(const py::slice &) const>(&pyjagger::TokenLine::at))
+      .def("to_list", &pyjagger::TokenLine::to_list)
+      .def("__repr__", &pyjagger::TokenLine::repr);
 
   py::class_<jagger::PyToken>(m, "Token")
       .def(py::init<>())
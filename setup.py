@@ -1,3 +1,4 @@
+import os
 import sys
 
 from setuptools import setup
@@ -9,11 +10,24 @@ dev_mode = False
 jagger_compile_args=[
   ]
 
+jagger_define_macros=[
+  ]
+
+jagger_libraries=[
+  ]
+
 if sys.platform.startswith('win32'):
   # Assume MSVC
   pass
 else:
   jagger_compile_args.append("-std=c++11")
+  # mmap model files(zero-copy, pages are shared among processes)
+  jagger_define_macros.append(("JAGGER_USE_MMAP_IO", "1"))
+  # decompress gzip input of tokenize_file when zlib is installed
+  zlib_include_dirs = ['/usr/include', '/usr/local/include', os.path.join(sys.prefix, 'include')]
+  if any(os.path.exists(os.path.join(d, 'zlib.h')) for d in zlib_include_dirs):
+    jagger_define_macros.append(("JAGGER_WITH_ZLIB", "1"))
+    jagger_libraries.append('z')
 
 
 if dev_mode:
@@ -24,6 +38,8 @@ if dev_mode:
 ext_modules = [
     Pybind11Extension("jagger_ext", ["jagger/python-binding-jagger.cc"],
       include_dirs=['.'],
+      define_macros=jagger_define_macros,
+      libraries=jagger_libraries,
       extra_compile_args=jagger_compile_args,
     ),
 ]
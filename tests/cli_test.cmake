@@ -0,0 +1,164 @@
+# Tests of the jagger CLI and tools with the small model in tests/data.
+#
+# cmake -DCASE=<case> -DJAGGER=<jagger> -DJAGGER_COMPILE=<jagger-compile>
+#       -DJAGGER_PACK=<jagger-pack> -DDATA_DIR=<tests/data> -DWORK_DIR=<dir>
+#       -P cli_test.cmake
+#
+# expected.txt is the output of the jagger before the model compiler, the trie
+# layouts and the threaded CLI were added; every way of compiling a model and
+# of feeding input must reproduce it.
+
+cmake_minimum_required(VERSION 3.16)
+
+set(INPUT "${DATA_DIR}/input.txt")
+set(EXPECTED "${DATA_DIR}/expected.txt")
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+# run(<must_succeed> <stdin or ""> <stdout> <command> [args...])
+function(run must_succeed in out)
+  if (in)
+    set(in_args INPUT_FILE "${in}")
+  endif()
+  execute_process(
+    COMMAND ${ARGN} ${in_args}
+    OUTPUT_FILE "${out}"
+    ERROR_VARIABLE err
+    RESULT_VARIABLE ret)
+  if (must_succeed AND NOT ret EQUAL 0)
+    message(FATAL_ERROR "failed(${ret}): ${ARGN}\n${err}")
+  elseif (NOT must_succeed AND ret EQUAL 0)
+    message(FATAL_ERROR "unexpectedly succeeded: ${ARGN}")
+  endif()
+endfunction()
+
+function(expect_same a b)
+  execute_process(
+    COMMAND "${CMAKE_COMMAND}" -E compare_files "${a}" "${b}"
+    RESULT_VARIABLE ret)
+  if (NOT ret EQUAL 0)
+    message(FATAL_ERROR "${a} differs from ${b}")
+  endif()
+endfunction()
+
+# compiles tests/data/patterns into <dir>/patterns with the given options
+function(compile dir)
+  file(MAKE_DIRECTORY "${WORK_DIR}/${dir}")
+  configure_file("${DATA_DIR}/patterns" "${WORK_DIR}/${dir}/patterns" COPYONLY)
+  run(TRUE "" "${WORK_DIR}/${dir}/compile.log"
+      "${JAGGER_COMPILE}" -q ${ARGN} "${WORK_DIR}/${dir}/patterns")
+endfunction()
+
+# tags <in> with <dir>/patterns and compares the output with <expected>
+function(tag_and_compare dir in expected)
+  string(MAKE_C_IDENTIFIER "${ARGN}" name)
+  set(out "${WORK_DIR}/${dir}/out${name}.txt")
+  run(TRUE "${in}" "${out}" "${JAGGER}" -m "${WORK_DIR}/${dir}/patterns" ${ARGN})
+  expect_same("${out}" "${expected}")
+endfunction()
+
+# a block of lines without tokens writes only EOS
+function(empty_lines)
+  string(REPEAT "\n" 300000 text)
+  file(WRITE "${WORK_DIR}/empty.txt" "${text}")
+  string(REPEAT "EOS\n" 300000 text)
+  file(WRITE "${WORK_DIR}/eos.txt" "${text}")
+endfunction()
+
+if (CASE STREQUAL "compile")
+  # patterns compiled on the first load
+  file(MAKE_DIRECTORY "${WORK_DIR}/load")
+  configure_file("${DATA_DIR}/patterns" "${WORK_DIR}/load/patterns" COPYONLY)
+  tag_and_compare(load "${INPUT}" "${EXPECTED}")
+
+  foreach (order freq bfs dfs)
+    compile(${order} -l ${order})
+    tag_and_compare(${order} "${INPUT}" "${EXPECTED}" -s)
+  endforeach()
+
+  # without the POS-context table
+  compile(nopos)
+  file(REMOVE "${WORK_DIR}/nopos/patterns.pos")
+  tag_and_compare(nopos "${INPUT}" "${EXPECTED}" -s)
+
+  # with a hot core
+  compile(hot -H 64)
+  tag_and_compare(hot "${INPUT}" "${EXPECTED}" -s)
+
+  # re-layout of a compiled model
+  compile(relayout)
+  run(TRUE "" "${WORK_DIR}/relayout/update.log"
+      "${JAGGER_COMPILE}" -q -u -r -l dfs "${WORK_DIR}/relayout/patterns")
+  tag_and_compare(relayout "${INPUT}" "${EXPECTED}" -s)
+
+  # packed model written by jagger-compile -p and by jagger-pack
+  compile(packed -p -H 64)
+  tag_and_compare(packed "${INPUT}" "${EXPECTED}" -s)
+  compile(pack)
+  run(TRUE "" "${WORK_DIR}/pack/pack.log" "${JAGGER_PACK}" "${WORK_DIR}/pack/patterns")
+  run(TRUE "" "${WORK_DIR}/pack/verify.log" "${JAGGER_PACK}" -v "${WORK_DIR}/pack/patterns.jgm")
+  tag_and_compare(pack "${INPUT}" "${EXPECTED}" -s)
+
+elseif (CASE STREQUAL "threads")
+  compile(m)
+  tag_and_compare(m "${INPUT}" "${EXPECTED}" -f)
+  tag_and_compare(m "${INPUT}" "${EXPECTED}" -j 1)
+  tag_and_compare(m "${INPUT}" "${EXPECTED}" -j 3)
+  tag_and_compare(m "${INPUT}" "${EXPECTED}" -f -j 3)
+  tag_and_compare(m "" "${EXPECTED}" -i "${INPUT}")
+  tag_and_compare(m "" "${EXPECTED}" -j 3 -i "${INPUT}")
+  run(TRUE "${INPUT}" "${WORK_DIR}/m/w.txt" "${JAGGER}" -m "${WORK_DIR}/m/patterns" -w)
+  tag_and_compare(m "${INPUT}" "${WORK_DIR}/m/w.txt" -w -j 3)
+  tag_and_compare(m "" "${WORK_DIR}/m/w.txt" -w -i "${INPUT}")
+
+elseif (CASE STREQUAL "long_line")
+  # a line longer than the I/O buffers of the CLI (256 KB)
+  file(READ "${INPUT}" text)
+  string(REPLACE "\n" "" text "${text}")
+  string(REPEAT "${text}" 48 text)
+  set(long "${WORK_DIR}/long.txt")
+  file(WRITE "${long}" "${text}\n${text}\n")
+  compile(m)
+  run(TRUE "${long}" "${WORK_DIR}/m/long.txt" "${JAGGER}" -m "${WORK_DIR}/m/patterns")
+  file(SIZE "${WORK_DIR}/m/long.txt" size)
+  if (size LESS 1000000)
+    message(FATAL_ERROR "output of long lines is too short: ${size} bytes")
+  endif()
+  tag_and_compare(m "${long}" "${WORK_DIR}/m/long.txt" -f)
+  tag_and_compare(m "${long}" "${WORK_DIR}/m/long.txt" -j 3)
+  tag_and_compare(m "" "${WORK_DIR}/m/long.txt" -i "${long}")
+
+elseif (CASE STREQUAL "empty_lines")
+  empty_lines()
+  compile(m)
+  tag_and_compare(m "${WORK_DIR}/empty.txt" "${WORK_DIR}/eos.txt" -j 2)
+  tag_and_compare(m "${WORK_DIR}/empty.txt" "${WORK_DIR}/eos.txt" -f -j 3)
+  tag_and_compare(m "${WORK_DIR}/empty.txt" "${WORK_DIR}/eos.txt" -f)
+  # invalid -j
+  foreach (n -1 x 2x "")
+    run(FALSE "${INPUT}" "${WORK_DIR}/m/invalid.txt"
+        "${JAGGER}" -m "${WORK_DIR}/m/patterns" -j "${n}")
+  endforeach()
+
+elseif (CASE STREQUAL "empty_lines_mmap")
+  # a mapped file (-i) tagged by tag_lines () as well
+  empty_lines()
+  compile(m)
+  tag_and_compare(m "" "${WORK_DIR}/eos.txt" -i "${WORK_DIR}/empty.txt")
+  tag_and_compare(m "" "${WORK_DIR}/eos.txt" -j 2 -i "${WORK_DIR}/empty.txt")
+
+elseif (CASE STREQUAL "gzip")
+  compile(m)
+  tag_and_compare(m "${DATA_DIR}/input.txt.gz" "${EXPECTED}")
+  tag_and_compare(m "${DATA_DIR}/input.txt.gz" "${EXPECTED}" -j 3)
+  tag_and_compare(m "" "${EXPECTED}" -i "${DATA_DIR}/input.txt.gz")
+  # a truncated stream is an error, not a short output
+  run(FALSE "${DATA_DIR}/truncated.txt.gz" "${WORK_DIR}/m/truncated.txt"
+      "${JAGGER}" -m "${WORK_DIR}/m/patterns")
+  run(FALSE "" "${WORK_DIR}/m/truncated.txt"
+      "${JAGGER}" -m "${WORK_DIR}/m/patterns" -i "${DATA_DIR}/truncated.txt.gz")
+
+else()
+  message(FATAL_ERROR "unknown CASE: ${CASE}")
+endif()
@@ -0,0 +1,274 @@
+# Tests of the Python binding with the small model in tests/data.
+#
+#   $ python -m pip install . pytest
+#   $ python -m pytest tests
+
+import gzip
+import mmap
+import shutil
+from concurrent.futures import ThreadPoolExecutor
+from pathlib import Path
+
+import pytest
+
+import jagger
+
+DATA_DIR = Path(__file__).resolve().parent / "data"
+
+
+@pytest.fixture(scope="module")
+def model_path(tmp_path_factory):
+    # patterns are compiled into files next to it on the first load
+    path = tmp_path_factory.mktemp("model") / "patterns"
+    shutil.copyfile(str(DATA_DIR / "patterns"), str(path))
+    return path
+
+
+@pytest.fixture(scope="module")
+def tokenizer(model_path):
+    tokenizer = jagger.Jagger()
+    assert tokenizer.load_model(model_path)
+    return tokenizer
+
+
+@pytest.fixture(scope="module")
+def text():
+    return (DATA_DIR / "input.txt").read_bytes().decode("utf-8")
+
+
+def pairs(toks_list):
+    return [[(tok.surface(), tok.feature()) for tok in toks] for toks in toks_list]
+
+
+def expected_pairs():
+    # output of the jagger CLI; tokenize_batch returns no tokens for empty lines
+    toks_list, toks = [], []
+    for row in (DATA_DIR / "expected.txt").read_bytes().decode("utf-8").split("\n"):
+        if row == "EOS":
+            if toks:
+                toks_list.append(toks)
+            toks = []
+        elif row:
+            toks.append(tuple(row.split("\t")))
+    return toks_list
+
+
+def test_tokenize_batch(tokenizer, text):
+    assert pairs(tokenizer.tokenize_batch(text)) == expected_pairs()
+
+
+def test_tokenize(tokenizer, text):
+    lines = [line for line in text.split("\n") if line]
+    assert pairs(tokenizer.tokenize(line) for line in lines) == expected_pairs()
+
+
+@pytest.mark.parametrize("nthreads", [1, 3])
+def test_set_threads(model_path, text, nthreads):
+    tokenizer = jagger.Jagger()
+    tokenizer.load_model(model_path)
+    tokenizer.set_threads(nthreads)
+    assert pairs(tokenizer.tokenize_batch(text)) == expected_pairs()
+
+
+def test_python_threads(tokenizer, text):
+    # one tokenizer shared by Python threads(the GIL is released while tagging)
+    lines = [line for line in text.split("\n") if line] * 20
+    expected = expected_pairs() * 20
+    with ThreadPoolExecutor(max_workers=4) as pool:
+        assert pairs(pool.map(tokenizer.tokenize, lines)) == expected
+        results = list(pool.map(tokenizer.tokenize_batch, [text] * 20))
+    assert [pairs(res) for res in results] == [expected_pairs()] * 20
+
+
+def test_load_model_while_tokenizing(model_path, text):
+    tokenizer = jagger.Jagger()
+    tokenizer.load_model(model_path)
+
+    def reload(n):
+        for _ in range(n):
+            assert tokenizer.load_model(model_path)
+
+    with ThreadPoolExecutor(max_workers=4) as pool:
+        reloading = pool.submit(reload, 20)
+        results = list(pool.map(tokenizer.tokenize_batch, [text] * 40))
+        reloading.result()
+    assert [pairs(res) for res in results] == [expected_pairs()] * 40
+
+
+@pytest.mark.parametrize("nthreads", [1, 3])
+def test_line_breaks(model_path, text, nthreads):
+    # "\n", "\r\n" and "\r" end a line; the end of the text ends the last line
+    tokenizer = jagger.Jagger()
+    tokenizer.load_model(model_path)
+    tokenizer.set_threads(nthreads)
+    lines = text.split("\n") * 50
+    mixed = "".join(line + ("\n", "\r\n", "\r")[i % 3] for i, line in enumerate(lines))
+    expected = pairs(tokenizer.tokenize_batch("\n".join(lines)))
+    assert expected == expected_pairs() * 50
+    assert pairs(tokenizer.tokenize_batch(mixed)) == expected
+    assert pairs(tokenizer.tokenize_batch(mixed.encode("utf-8"))) == expected
+    assert pairs(tokenizer.tokenize_batch(text.replace("\n", "\r\n").rstrip("\r\n"))) == expected_pairs()
+
+
+def test_split_long_line(model_path, text):
+    # a long line is tagged in pieces by the worker threads with the same result
+    tokenizer = jagger.Jagger()
+    tokenizer.load_model(model_path)
+    tokenizer.set_threads(4)
+    line = text.replace("\n", "") * 40
+    tokenizer.set_split_threshold(0)
+    expected = pairs(tokenizer.tokenize_batch(line))
+    assert len(expected) == 1 and len(expected[0]) > 40000
+    for nbytes in (1, 4096, 64 * 1024):
+        tokenizer.set_split_threshold(nbytes)
+        assert pairs(tokenizer.tokenize_batch(line)) == expected
+        assert pairs(tokenizer.tokenize_batch([line, line])) == expected * 2
+        assert pairs([tokenizer.tokenize(line)]) == expected
+
+
+def array_pairs(tokenizer, res, data):
+    features = [tokenizer.feature_table(), tokenizer.feature_table(True)]
+    begin, end, feature, lines = list(res.begin), list(res.end), list(res.feature), list(res.lines)
+    toks_list = []
+    for i in range(len(lines) - 1):
+        toks_list.append([(data[begin[k]:end[k]].decode("utf-8"), features[feature[k] >> 31][feature[k] & 0x7FFFFFFF])
+                          for k in range(lines[i], lines[i + 1])])
+    return toks_list
+
+
+@pytest.mark.parametrize("nthreads", [1, 3])
+def test_tokenize_batch_arrays(model_path, text, nthreads):
+    tokenizer = jagger.Jagger()
+    tokenizer.load_model(model_path)
+    tokenizer.set_threads(nthreads)
+    data = text.encode("utf-8")
+    for src in (text, data, memoryview(data), bytearray(data)):
+        res = tokenizer.tokenize_batch_arrays(src)
+        assert array_pairs(tokenizer, res, data) == expected_pairs()
+
+    res = tokenizer.tokenize_batch_arrays(data)
+    assert memoryview(res.begin).format == "q" and memoryview(res.end).format == "q"
+    assert memoryview(res.feature).format == "I" and memoryview(res.lines).format == "q"
+    assert len(res.begin) == len(res.end) == len(res.feature) == res.lines[len(res.lines) - 1]
+
+    # pieces of a long line
+    line = (text.replace("\n", "") * 10).encode("utf-8")
+    tokenizer.set_split_threshold(4096)
+    assert array_pairs(tokenizer, tokenizer.tokenize_batch_arrays(line), line) == pairs(tokenizer.tokenize_batch(line))
+
+    assert len(tokenizer.tokenize_batch_arrays(b"").lines) == 1
+
+
+def test_tokenize_batch_arrays_invalid_utf8(tokenizer, text):
+    data = text.encode("utf-8")
+    for bad in (b"\xff", b"\xe3\x81", b"\xed\xa0\x80", b"\xc0\xaf"):
+        with pytest.raises(ValueError):
+            tokenizer.tokenize_batch_arrays(data + bad + data)
+
+
+def test_tokenize_batch_inputs(tokenizer, text):
+    expected = expected_pairs()
+    data = text.encode("utf-8")
+    for src in (data, memoryview(data), bytearray(data)):
+        assert pairs(tokenizer.tokenize_batch(src)) == expected
+    with open(str(DATA_DIR / "input.txt"), "rb") as f:
+        with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as m:
+            assert pairs(tokenizer.tokenize_batch(m)) == expected
+
+    lines = [line for line in text.split("\n") if line]
+    assert pairs(tokenizer.tokenize_batch(lines)) == expected
+    assert pairs(tokenizer.tokenize_batch([line.encode("utf-8") for line in lines])) == expected
+    # tokens for each item; a trailing newline is ignored
+    items = [lines[0] + "\n", lines[1].encode("utf-8") + b"\r\n", "", lines[2]]
+    assert pairs(tokenizer.tokenize_batch(items)) == expected[:2] + [[]] + expected[2:3]
+    assert tokenizer.tokenize_batch([]) == []
+
+
+def test_tokenize_batch_copies_input(tokenizer, text):
+    data = bytearray(text.encode("utf-8"))
+    lines = [line.encode("utf-8") for line in text.split("\n") if line]
+    res = tokenizer.tokenize_batch(data, lazy=True)
+    res_list = tokenizer.tokenize_batch(lines, lazy=True)
+    data[:] = b"x" * len(data)
+    del lines
+    assert pairs(res) == expected_pairs()
+    assert pairs(res_list) == expected_pairs()
+
+
+def test_tokenize_invalid_utf8(tokenizer):
+    for bad in (b"\xff\n", "吾輩".encode("utf-8") + b"\n\xe3\x81", b"\xed\xa0\x80", b"\xc0\xaf"):
+        with pytest.raises(ValueError):
+            tokenizer.tokenize_batch(bad)
+        with pytest.raises(ValueError):
+            tokenizer.tokenize_batch(memoryview(bad))
+        with pytest.raises(ValueError):
+            tokenizer.tokenize_batch(["吾輩", bad])
+        with pytest.raises(ValueError):
+            tokenizer.tokenize(bad)
+    with pytest.raises(TypeError):
+        tokenizer.tokenize_batch(["吾輩", 1])
+
+
+def test_lazy_result(tokenizer, text):
+    res = tokenizer.tokenize_batch(text, lazy=True)
+    expected = expected_pairs()
+    assert len(res) == len(expected)
+    assert pairs([res[0], res[-1]]) == [expected[0], expected[-1]]
+    assert pairs(res[2:20:3]) == expected[2:20:3]
+    assert pairs(res[::-1]) == expected[::-1]
+    assert pairs([res[3][1:4], res[3][-2:]]) == [expected[3][1:4], expected[3][-2:]]
+    assert pairs(res.to_list()) == expected
+    assert repr(res) == repr(tokenizer.tokenize_batch(text))
+    assert repr(res[0]) == repr(res.to_list()[0])
+    with pytest.raises(IndexError):
+        res[len(res)]
+    with pytest.raises(IndexError):
+        res[0][len(res[0])]
+
+
+def assert_repeated(res, expected, n):
+    assert len(res) == len(expected) * n
+    for i in range(n):
+        assert pairs(res[i * len(expected):(i + 1) * len(expected)]) == expected
+
+
+def test_tokenize_file(tokenizer, text, tmp_path):
+    assert pairs(tokenizer.tokenize_file(DATA_DIR / "input.txt")) == expected_pairs()
+    # read in blocks of lines
+    path = tmp_path / "large.txt"
+    path.write_bytes(text.replace("\n", "\r\n").encode("utf-8") * 600)
+    assert_repeated(tokenizer.tokenize_file(path, lazy=True), expected_pairs(), 600)
+
+    # OSError as Python file APIs raise
+    with pytest.raises(FileNotFoundError):
+        tokenizer.tokenize_file(tmp_path / "missing.txt")
+    with pytest.raises(OSError):
+        tokenizer.tokenize_file(tmp_path)  # a directory
+    path = tmp_path / "invalid.txt"
+    path.write_bytes(text.encode("utf-8") * 1000 + b"\xe3\x81\n")
+    with pytest.raises(ValueError, match="invalid UTF-8"):
+        tokenizer.tokenize_file(path)
+
+
+def test_tokenize_file_gzip(tokenizer, text, tmp_path):
+    try:
+        res = tokenizer.tokenize_file(DATA_DIR / "input.txt.gz")
+    except OSError as e:
+        if "without zlib" in str(e):
+            pytest.skip("built without zlib")
+        raise
+    assert pairs(res) == expected_pairs()
+    # truncated streams are errors, not short results
+    with pytest.raises(OSError, match="unexpected end of gzip input"):
+        tokenizer.tokenize_file(DATA_DIR / "truncated.txt.gz")
+
+    data = gzip.compress(text.encode("utf-8") * 600)
+    path = tmp_path / "large.txt.gz"
+    path.write_bytes(data)
+    assert_repeated(tokenizer.tokenize_file(path, lazy=True), expected_pairs(), 600)
+    path.write_bytes(data[:len(data) // 2])
+    with pytest.raises(OSError, match="unexpected end of gzip input"):
+        tokenizer.tokenize_file(path)
+    # concatenated members
+    path.write_bytes(data + data)
+    assert_repeated(tokenizer.tokenize_file(path, lazy=True), expected_pairs(), 1200)